@@ -1,8 +1,12 @@
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <exception>
 #include <iostream>
+#include <limits>
 
 #include "AABB.hpp"
+#include "Profiler.hpp"
 
 namespace aabb {
 
@@ -30,219 +34,542 @@ bool AABB::contains(const AABB &aabb) const {
   return pos <= aabb.pos && (pos + dim) >= (aabb.pos + aabb.dim);
 }
 
+// Right and bottom edges are exclusive so that a point belongs to one tile
+bool AABB::contains(const geom::Point<float> &point) const {
+  return pos <= point && point < (pos + dim);
+}
+
 bool AABB::overlaps(const AABB &aabb) const {
   return pos < (aabb.pos + aabb.dim) && (pos + dim) > aabb.pos;
 }
 
-unsigned int AABB::area() { return dim.x * dim.y; }
+unsigned int AABB::area() const { return dim.x * dim.y; }
+
+float AABB::perimeter() const { return 2 * (dim.x + dim.y); }
+
+Corners::Corners(float x, float y, float nx, float ny)
+    : x(x), y(y), nx(nx), ny(ny){};
+
+Corners::Corners(const AABB &aabb)
+    : Corners(aabb.pos.x, aabb.pos.y, -(aabb.pos.x + aabb.dim.x),
+              -(aabb.pos.y + aabb.dim.y)){};
 
-Node::Node()
-    : id(entt::null), aabb(0, 0, 0, 0), fatten(0, 0, 0, 0), next(NULL_NODE),
-      parent(NULL_NODE), left(NULL_NODE), right(NULL_NODE){};
+AABB Corners::box() const { return AABB{x, y, -nx - x, -ny - y}; }
 
-bool Node::is_leaf() const { return left == NULL_NODE; }
+Corners Corners::unite(const Corners &other) const {
+  return {std::min(x, other.x), std::min(y, other.y), std::min(nx, other.nx),
+          std::min(ny, other.ny)};
+}
 
-bool Node::is_valid() { return fatten.contains(aabb); }
+bool Corners::contains(const AABB &aabb) const {
+  auto max = aabb.pos + aabb.dim;
+  return x <= aabb.pos.x && y <= aabb.pos.y && nx <= -max.x && ny <= -max.y;
+}
+
+bool Corners::contains(const Corners &other) const {
+  return x <= other.x && y <= other.y && nx <= other.nx && ny <= other.ny;
+}
+
+bool Corners::overlaps(const Corners &other) const {
+  return x < -other.nx && y < -other.ny && other.x < -nx && other.y < -ny;
+}
+
+float Corners::perimeter() const { return -2 * ((x + nx) + (y + ny)); }
+
+AABB Children::box(int side) const { return corners(side).box(); }
+
+Corners Children::corners(int side) const {
+  return {lo[side * 2], lo[side * 2 + 1], hi[side * 2], hi[side * 2 + 1]};
+}
+
+Probe::Probe(const AABB &aabb) {
+  auto max = aabb.pos + aabb.dim;
+  for (auto i = 0; i < 4; i += 2) {
+    lo[i] = max.x;
+    lo[i + 1] = max.y;
+    hi[i] = -aabb.pos.x;
+    hi[i + 1] = -aabb.pos.y;
+  }
+}
 
 Tree::Tree(float margin, unsigned int init_cap)
-    : root(NULL_NODE), margin(margin), count(0), capacity(init_cap) {
-  nodes.resize(capacity);
-  for (auto i = 0; i < capacity - 1; ++i) {
-    nodes[i].next = i + 1;
+    : root(NULL_NODE), margin(margin), root_fatten(0, 0, 0, 0), count(0),
+      capacity(init_cap) {
+  bounds.resize(capacity, AABB{0, 0, 0, 0});
+  children.resize(capacity);
+  links.resize(capacity);
+  ids.resize(capacity, entt::null);
+  for (auto i = 0u; i < capacity - 1; ++i) {
+    links[i].next = i + 1;
   }
-  nodes[capacity - 1].next = NULL_NODE;
+  links[capacity - 1].next = NULL_NODE;
   empty_node = 0;
 }
 
 unsigned int Tree::add(entt::entity id, const AABB &aabb) {
   auto node = alloc_node();
-  nodes[node].id = id;
-  nodes[node].aabb = aabb;
-  update_node(node, margin);
+  ids[node] = id;
+  bounds[node] = aabb;
+  insert_node(node);
+  return node;
+}
+
+void Tree::remove(unsigned int node) { remove_node(node); }
+
+// Top-down: ranges of leaves are split and linked under new branches, then
+// the branches are refitted in reverse order of creation, children first.
+std::vector<unsigned int>
+Tree::build(const std::vector<std::pair<entt::entity, AABB>> &leaves) {
+  std::vector<unsigned int> result;
+  result.reserve(leaves.size());
+  for (auto &[id, aabb] : leaves) {
+    auto node = alloc_node();
+    ids[node] = id;
+    bounds[node] = aabb;
+    result.push_back(node);
+  }
+  if (result.empty())
+    return result;
+
+  struct Task {
+    unsigned int begin, end;
+    unsigned int parent;
+    int side;
+  };
+  auto order = result;
+  std::vector<unsigned int> branches;
+  branches.reserve(order.size());
+  std::vector<Task> tasks{{0, (unsigned int)order.size(), NULL_NODE, 0}};
+  auto top = NULL_NODE;
+  while (tasks.size()) {
+    auto [begin, end, parent, side] = tasks.back();
+    tasks.pop_back();
+
+    auto node = order[begin];
+    if (end - begin > 1) {
+      node = alloc_node();
+      links[node].leaf = false;
+      branches.push_back(node);
+      auto mid = split(order.data() + begin, order.data() + end) + begin;
+      // Left goes first so that store() finds it in node[0]
+      tasks.push_back({mid, end, node, 1});
+      tasks.push_back({begin, mid, node, 0});
+    }
+    links[node].parent = parent;
+    if (parent == NULL_NODE) {
+      top = node;
+      continue;
+    }
+    children[parent].node[side] = node;
+    if (is_leaf(node))
+      store(parent, {node, leaf_fatten(node), 0});
+  }
+  for (auto i = branches.size(); i-- > 1;)
+    store(links[branches[i]].parent, refit(branches[i]));
+
+  auto built = is_leaf(top) ? Slot{top, leaf_fatten(top), 0} : refit(top);
   if (root == NULL_NODE) {
-    root = node;
+    root = top;
+    root_fatten = built.fatten.box();
   } else {
-    insert_node(node, root);
+    // Hang the new subtree next to the old one
+    auto branch = alloc_node();
+    link(branch, root_slot(), built);
+    root = branch;
+    links[branch].parent = NULL_NODE;
+    root_fatten = refit(branch).fatten.box();
   }
-  return node;
+  return result;
 }
 
-void Tree::remove(unsigned int node) { remove_node(node); }
+// Partitions leaves by the cheapest of the planes between 16 bins of their
+// centers along the longer axis. Returns the size of the left part.
+unsigned int Tree::split(unsigned int *begin, unsigned int *end) const {
+  constexpr auto BINS = 16;
+  auto count = (unsigned int)(end - begin);
+
+  auto low = bounds[*begin].center();
+  auto high = low;
+  for (auto i = begin; i != end; ++i) {
+    auto center = bounds[*i].center();
+    low = geom::min(low, center);
+    high = geom::max(high, center);
+  }
+  auto extent = high - low;
+  auto axis = extent.x >= extent.y ? 0 : 1;
+  auto from = axis ? low.y : low.x;
+  auto length = axis ? extent.y : extent.x;
+  if (length <= 0)
+    return count / 2;
+
+  auto bin = [&](unsigned int node) {
+    auto center = bounds[node].center();
+    auto index = (int)(BINS * ((axis ? center.y : center.x) - from) / length);
+    return std::min(index, BINS - 1);
+  };
+
+  struct Bin {
+    unsigned int count = 0;
+    Corners box{0, 0, 0, 0};
+  };
+  Bin bins[BINS];
+  for (auto i = begin; i != end; ++i) {
+    auto &current = bins[bin(*i)];
+    auto fatten = leaf_fatten(*i);
+    current.box = current.count ? current.box.unite(fatten) : fatten;
+    ++current.count;
+  }
+
+  // Cost of the left part of every plane, then sweep from the right
+  float left_cost[BINS - 1];
+  Bin sweep;
+  for (auto i = 0; i < BINS - 1; ++i) {
+    if (bins[i].count)
+      sweep.box = sweep.count ? sweep.box.unite(bins[i].box) : bins[i].box;
+    sweep.count += bins[i].count;
+    left_cost[i] = sweep.count * sweep.box.perimeter();
+  }
+  auto best = -1;
+  auto best_cost = std::numeric_limits<float>::max();
+  sweep = {};
+  for (auto i = BINS - 1; i > 0; --i) {
+    if (bins[i].count)
+      sweep.box = sweep.count ? sweep.box.unite(bins[i].box) : bins[i].box;
+    sweep.count += bins[i].count;
+    auto cost = left_cost[i - 1] + sweep.count * sweep.box.perimeter();
+    if (sweep.count < count && sweep.count && cost < best_cost) {
+      best_cost = cost;
+      best = i - 1;
+    }
+  }
+  if (best < 0)
+    return count / 2;
+
+  auto mid = std::partition(
+      begin, end, [&](unsigned int node) { return bin(node) <= best; });
+  return (unsigned int)(mid - begin);
+}
 
 void Tree::update() {
+  PROFILE_SCOPE("Tree::update");
   if (root != NULL_NODE) {
-    if (nodes[root].is_leaf()) {
-      update_node(root, margin);
+    if (is_leaf(root)) {
+      root_fatten = leaf_fatten(root).box();
     } else {
-      std::vector<unsigned int> invalid_nodes;
-      invalid_nodes.reserve(64); // TODO: replace hardcoded constant
-      check_nodes(root, invalid_nodes);
-      for (auto &node : invalid_nodes) {
-        pull_node(node);
-        update_node(node, margin);
-        insert_node(node, root);
-      }
+      escaped.clear();
+      check_nodes(escaped);
+      reinserted += escaped.size();
+      for (auto node : escaped)
+        reinsert(node);
     }
   }
 }
 
-std::vector<entt::entity> Tree::query(unsigned int node) const {
-  std::vector<unsigned int> stack;
-  stack.reserve(256);
-  stack.push_back(root);
+void Tree::update(const std::vector<unsigned int> &moved) {
+  PROFILE_SCOPE("Tree::update");
+  if (root == NULL_NODE)
+    return;
+  if (is_leaf(root)) {
+    root_fatten = leaf_fatten(root).box();
+    return;
+  }
+  escaped.clear();
+  for (auto node : moved) {
+    if (!slot(node).fatten.contains(bounds[node]))
+      escaped.push_back(node);
+  }
+  reinserted += escaped.size();
+  for (auto node : escaped)
+    reinsert(node);
+}
 
+AABB Tree::fatten(unsigned int node) const {
+  auto parent = links[node].parent;
+  if (parent == NULL_NODE)
+    return root_fatten;
+  auto &current = children[parent];
+  return current.box(current.node[0] == node ? 0 : 1);
+}
+
+std::vector<entt::entity> Tree::query(unsigned int node) const {
+  PROFILE_SCOPE("Tree::query");
   std::vector<entt::entity> result;
+  query(bounds[node], [&](unsigned int current) {
+    // Can't interact with itself
+    if (current != node)
+      result.push_back(ids[current]);
+  });
+  return result;
+}
 
-  while (stack.size()) {
-    auto current = stack.back();
-    stack.pop_back();
+std::size_t Tree::query(const AABB &aabb,
+                        std::vector<entt::entity> &out) const {
+  PROFILE_SCOPE("Tree::query");
+  auto size = out.size();
+  query(aabb, [&](unsigned int node) { out.push_back(ids[node]); });
+  return out.size() - size;
+}
 
-    if (current == NULL_NODE)
-      continue;
+entt::entity Tree::pick(const geom::Point<float> &point) const {
+  entt::entity result = entt::null;
+  pick(point, [&](unsigned int node) {
+    result = ids[node];
+    return false;
+  });
+  return result;
+}
 
-    // Test for overlap between the AABBs.
-    if (nodes[current].aabb.overlaps(nodes[node].aabb)) {
-      // Check that we're at a leaf node.
-      if (nodes[current].is_leaf()) {
-        // Can't interact with itself.
-        if (current != node) {
-          result.push_back(nodes[current].id);
-        }
-      } else {
-        stack.push_back(nodes[current].right);
-        stack.push_back(nodes[current].left);
+namespace {
+
+// Slab test of a box moving by delta against the boxes in its way, which
+// it overlaps while its corner is inside them grown by its size
+struct Sweep {
+  float origin[2], size[2], delta[2], inverse[2];
+
+  Sweep(const AABB &aabb, const geom::Vector<float> &move)
+      : origin{aabb.pos.x, aabb.pos.y}, size{aabb.dim.x, aabb.dim.y},
+        delta{move.x, move.y}, inverse{1 / move.x, 1 / move.y} {}
+
+  // Fractions of the move where the overlap with target starts and ends,
+  // false when there is none. axis is the one whose slab is entered last.
+  bool overlap(const AABB &target, float &enter, float &exit,
+               int &axis) const {
+    auto infinity = std::numeric_limits<float>::infinity();
+    enter = -infinity;
+    exit = infinity;
+    axis = 0;
+    float lo[2] = {target.pos.x - size[0], target.pos.y - size[1]};
+    float hi[2] = {target.pos.x + target.dim.x, target.pos.y + target.dim.y};
+    for (auto i = 0; i < 2; ++i) {
+      if (delta[i] == 0) {
+        if (origin[i] <= lo[i] || origin[i] >= hi[i])
+          return false;
+        continue;
+      }
+      auto near = ((delta[i] > 0 ? lo[i] : hi[i]) - origin[i]) * inverse[i];
+      auto far = ((delta[i] > 0 ? hi[i] : lo[i]) - origin[i]) * inverse[i];
+      if (near > enter) {
+        enter = near;
+        axis = i;
       }
+      exit = std::min(exit, far);
     }
+    return enter < exit && exit > 0;
   }
-  return result;
-}
 
-// Use to print current tree (from left to right)
-void Tree::print() {
-  std::vector<unsigned int> stack;
-  stack.reserve(256);
-  stack.push_back(root);
+  // Whether a fat box is reached before limit, t is where
+  bool reach(const AABB &target, float limit, float &t) const {
+    float exit;
+    int axis;
+    if (!overlap(target, t, exit, axis) || t > limit)
+      return false;
+    t = std::max(t, .0f);
+    return true;
+  }
+};
 
-  while (stack.size()) {
-    auto current = stack.back();
-    stack.pop_back();
+} // namespace
 
-    if (current == NULL_NODE)
-      continue;
+RayHit Tree::ray_cast(const geom::Point<float> &origin,
+                      const geom::Vector<float> &delta) const {
+  return cast(AABB{origin, geom::Vector{.0f, .0f}}, delta, true);
+}
+
+RayHit Tree::sweep(const AABB &aabb, const geom::Vector<float> &delta) const {
+  return cast(aabb, delta, false);
+}
 
-    std::cout << "node[" << current << "] ";
-    if (nodes[current].is_leaf()) {
-      std::cout << "leaf\n";
+// Branches wait on the stack with the fraction where they are entered, so
+// that once a nearer hit is found they are dropped without a test
+RayHit Tree::cast(const AABB &aabb, const geom::Vector<float> &delta,
+                  bool inside) const {
+  RayHit best{NULL_NODE, 1.0f, geom::Vector{.0f, .0f}};
+  if (root == NULL_NODE)
+    return best;
+  QueryCount work{*this};
+  Sweep sweep{aabb, delta};
+  auto leaf = [&](unsigned int node) {
+    float enter, exit;
+    int axis;
+    if (!sweep.overlap(bounds[node], enter, exit, axis))
+      return;
+    auto normal = geom::Vector{.0f, .0f};
+    if (enter < 0) {
+      if (!inside)
+        return;
+      enter = 0;
+    } else if (axis == 0) {
+      normal.x = delta.x > 0 ? -1.0f : 1.0f;
+    } else {
+      normal.y = delta.y > 0 ? -1.0f : 1.0f;
+    }
+    if (enter > best.t || (enter == best.t && best.node != NULL_NODE))
+      return;
+    ++work.hits;
+    best = {node, enter, normal};
+  };
+
+  ++work.visited;
+  if (is_leaf(root)) {
+    leaf(root);
+    return best;
+  }
+  float t;
+  if (!sweep.reach(root_fatten, best.t, t))
+    return best;
+  auto &stack = cast_scratch();
+  auto base = stack.size();
+  stack.push_back({root, t});
+  while (stack.size() > base) {
+    auto [node, enter] = stack.back();
+    stack.pop_back();
+    if (enter > best.t)
       continue;
+    auto &current = children[node];
+    ++work.visited;
+    float near[2];
+    bool hit[2];
+    for (auto i = 0; i < 2; ++i)
+      hit[i] = sweep.reach(current.box(i), best.t, near[i]);
+    // The nearer child is handled last, so it ends up on top of the stack
+    auto first = hit[1] && (!hit[0] || near[1] < near[0]) ? 1 : 0;
+    for (auto i : {1 - first, first}) {
+      if (!hit[i])
+        continue;
+      if (current.leaf(i))
+        leaf(current.node[i]);
+      else
+        stack.push_back({current.node[i], near[i]});
     }
-    std::cout << "branch\n";
-
-    stack.push_back(nodes[current].right);
-    stack.push_back(nodes[current].left);
   }
+  return best;
+}
+
+std::vector<unsigned int> &Tree::scratch() {
+  thread_local std::vector<unsigned int> stack = [] {
+    std::vector<unsigned int> stack;
+    stack.reserve(256);
+    return stack;
+  }();
+  return stack;
+}
+
+std::vector<std::pair<unsigned int, float>> &Tree::cast_scratch() {
+  thread_local std::vector<std::pair<unsigned int, float>> stack = [] {
+    std::vector<std::pair<unsigned int, float>> stack;
+    stack.reserve(256);
+    return stack;
+  }();
+  return stack;
 }
 
-// Unfinished
-std::vector<std::pair<unsigned int, unsigned int>> Tree::overlaps() const {
-  if (root == NULL_NODE || nodes[root].is_leaf())
-    return {};
-
-  // std::vector<unsigned int> stack;
-  // stack.reserve(256);
-  // stack.push_back(nodes[root].left);
-  // stack.push_back(nodes[root].right);
-
-  std::vector<std::pair<unsigned int, unsigned int>> result;
-  std::vector<bool> checked(count, false);
-
-  get_overlaps(nodes[root].left, nodes[root].right, result, checked);
-  // while (stack.size() > 1) {
-  //   unsigned int n0 = stack.back();
-  //   unsigned int n1 = stack.back();
-  //   stack.pop_back();
-  //   stack.pop_back();
-
-  //   // Move on only if nodes have overlaps
-  //   if (nodes[n0].aabb.overlaps(nodes[n1].aabb)) {
-  //     if (nodes[n0].is_leaf()) {
-  //       if (nodes[n1].is_leaf()) { // both nodes are leaves
-  //         result.push_back({n0, n1});
-  //       } else { // n0 is leaf, n1 is branch
-  //         stack.push_back(n0);
-  //         stack.push_back(nodes[n1].right);
-  //         stack.push_back(n0);
-  //         stack.push_back(nodes[n1].left);
-  //       }
-  //     } else if (nodes[n1].is_leaf()) { // n0 is branch, n1 is leaf
-  //       stack.push_back(n1);
-  //       stack.push_back(nodes[n0].right);
-  //       stack.push_back(n1);
-  //       stack.push_back(nodes[n0].left);
-  //     } else { // both nodes are branches
-  //       stack.push_back(n1);
-  //       stack.push_back(nodes[n0].right);
-  //       stack.push_back(n1);
-  //       stack.push_back(nodes[n0].left);
-  //       stack.push_back(n0);
-  //       stack.push_back(nodes[n1].right);
-  //       stack.push_back(n0);
-  //       stack.push_back(nodes[n1].left);
-  //     }
-  //   }
-  // }
+// Smallest box whose overlap test matches AABB::contains for the point
+AABB Tree::point_box(const geom::Point<float> &point) {
+  auto infinity = std::numeric_limits<float>::infinity();
+  return AABB{point, geom::Vector{std::nextafter(point.x, infinity) - point.x,
+                                  std::nextafter(point.y, infinity) - point.y}};
+}
+
+// Use to print current tree (from left to right)
+void Tree::print() {
+  each([&](unsigned int node) {
+    std::cout << "node[" << node << "] "
+              << (is_leaf(node) ? "leaf\n" : "branch\n");
+  });
+}
 
+PairList Tree::overlaps() const {
+  PairList result;
+  overlaps(result);
   return result;
 }
 
-// Unfinished
-void Tree::get_overlaps(
-    unsigned int n0, unsigned int n1,
-    std::vector<std::pair<unsigned int, unsigned int>> &result,
-    std::vector<bool> &checked) const {
-  // Move on only if nodes have overlaps
-  // std::cout << "Tree::get_overlaps(" << std::to_string(n0) << ", "
-  //           << std::to_string(n1) << ")\n";
-  // std::cout << "[" << std::to_string(nodes[n0].aabb.x1) << ":"
-  //           << std::to_string(nodes[n0].aabb.y1) << "] - "
-  //           << "[" << std::to_string(nodes[n0].aabb.x2) << ":"
-  //           << std::to_string(nodes[n0].aabb.y2) << "] vs "
-  //           << "[" << std::to_string(nodes[n1].aabb.x1) << ":"
-  //           << std::to_string(nodes[n1].aabb.y1) << "] - "
-  //           << "[" << std::to_string(nodes[n1].aabb.x2) << ":"
-  //           << std::to_string(nodes[n1].aabb.y2) << "]\n";
-  if (nodes[n0].is_leaf()) {
-    if (nodes[n1].is_leaf()) { // both nodes are leaves
-      if (nodes[n0].aabb.overlaps(nodes[n1].aabb)) {
-        result.push_back({n0, n1});
-      }
-    } else { // n0 is leaf, n1 is branch
-      get_overlaps(n1, result, checked);
-      get_overlaps(n0, nodes[n1].left, result, checked);
-      get_overlaps(n0, nodes[n1].right, result, checked);
+// Self-collision of the tree: every overlapping pair of leaves is reported
+// exactly once. A stack entry (n, n) tests subtree n against itself, any
+// other entry tests two disjoint subtrees whose fat AABBs overlap.
+void Tree::overlaps(PairList &result) const {
+  result.clear();
+  if (root == NULL_NODE)
+    return;
+
+  // Fat boxes and leaf flags travel with the nodes, so only the packed
+  // children of split branches and the tight boxes of leaves are read
+  struct Entry {
+    Corners box0, box1;
+    unsigned int n0, n1;
+    bool leaf0, leaf1;
+  };
+  thread_local std::vector<Entry> stack;
+  stack.clear();
+  if (is_leaf(root))
+    return;
+  Corners top{root_fatten};
+  stack.push_back({top, top, root, root, false, false});
+
+  // Two leaves are tested right away instead of going on the stack
+  auto push = [&](const Corners &box0, const Corners &box1, unsigned int n0,
+                  unsigned int n1, bool leaf0, bool leaf1) {
+    if (!leaf0 || !leaf1)
+      stack.push_back({box0, box1, n0, n1, leaf0, leaf1});
+    else if (bounds[n0].overlaps(bounds[n1]))
+      result.push_back({n0, n1});
+  };
+
+  while (stack.size()) {
+    auto [box0, box1, n0, n1, leaf0, leaf1] = stack.back();
+    stack.pop_back();
+
+    if (n0 == n1) {
+      auto &current = children[n0];
+      auto left = current.corners(0);
+      auto right = current.corners(1);
+      if (left.overlaps(right))
+        push(left, right, current.node[0], current.node[1], current.leaf(0),
+             current.leaf(1));
+      if (!current.leaf(1))
+        stack.push_back(
+            {right, right, current.node[1], current.node[1], false, false});
+      if (!current.leaf(0))
+        stack.push_back(
+            {left, left, current.node[0], current.node[0], false, false});
+      continue;
     }
-  } else if (nodes[n1].is_leaf()) { // n0 is branch, n1 is leaf
-    get_overlaps(n0, result, checked);
-    get_overlaps(n1, nodes[n0].left, result, checked);
-    get_overlaps(n1, nodes[n0].right, result, checked);
-  } else { // both nodes are branches
-    get_overlaps(n0, result, checked);
-    get_overlaps(n1, result, checked);
-    get_overlaps(n0, nodes[n1].left, result, checked);
-    get_overlaps(n0, nodes[n1].right, result, checked);
-    get_overlaps(n1, nodes[n0].left, result, checked);
-    get_overlaps(n1, nodes[n0].right, result, checked);
-  }
-}
 
-// Unfinished
-void Tree::get_overlaps(
-    unsigned int node,
-    std::vector<std::pair<unsigned int, unsigned int>> &result,
-    std::vector<bool> &checked) const {
-  if (!checked[node]) {
-    get_overlaps(nodes[node].left, nodes[node].right, result, checked);
-    checked[node] = true;
+    // Two branches are split together, a branch against a leaf is split
+    // alone. Plain compares of the packed boxes measured faster than
+    // overlap_mask here, each box is needed anyway.
+    if (!leaf0 && !leaf1) {
+      auto &first = children[n0];
+      auto &second = children[n1];
+      for (auto i = 0; i < 2; ++i) {
+        auto fatten0 = first.corners(i);
+        if (!fatten0.overlaps(box1))
+          continue;
+        for (auto j = 0; j < 2; ++j) {
+          auto fatten1 = second.corners(j);
+          if (fatten0.overlaps(fatten1))
+            push(fatten0, fatten1, first.node[i], second.node[j],
+                 first.leaf(i), second.leaf(j));
+        }
+      }
+    } else if (leaf1) {
+      auto &current = children[n0];
+      for (auto i = 0; i < 2; ++i) {
+        auto fatten = current.corners(i);
+        if (fatten.overlaps(box1))
+          push(fatten, box1, current.node[i], n1, current.leaf(i), true);
+      }
+    } else {
+      auto &current = children[n1];
+      for (auto i = 0; i < 2; ++i) {
+        auto fatten = current.corners(i);
+        if (fatten.overlaps(box0))
+          push(box0, fatten, n0, current.node[i], true, current.leaf(i));
+      }
+    }
   }
+  if (counting)
+    pairs.fetch_add(result.size(), std::memory_order_relaxed);
 }
 
 unsigned int Tree::alloc_node() {
@@ -252,23 +579,27 @@ unsigned int Tree::alloc_node() {
     assert(count == capacity);
 
     // Double pool
-    nodes.resize(capacity *= 2);
+    capacity *= 2;
+    ++grows;
+    bounds.resize(capacity, AABB{0, 0, 0, 0});
+    children.resize(capacity);
+    links.resize(capacity);
+    ids.resize(capacity, entt::null);
 
     // Continue linked list
     for (auto i = count; i < capacity; ++i) {
-      nodes[i].next = i + 1;
+      links[i].next = i + 1;
     }
-    nodes[capacity - 1].next = NULL_NODE;
+    links[capacity - 1].next = NULL_NODE;
 
     empty_node = count;
   }
 
   // Get new node from pool
   auto node = empty_node;
-  empty_node = nodes[node].next;
-  nodes[node].parent = NULL_NODE;
-  nodes[node].left = NULL_NODE;
-  nodes[node].right = NULL_NODE;
+  empty_node = links[node].next;
+  links[node].parent = NULL_NODE;
+  links[node].leaf = true;
   ++count;
 
   return node;
@@ -278,97 +609,312 @@ void Tree::free_node(unsigned int node) {
   assert(node < capacity);
   assert(count > 0);
 
-  nodes[node].next = empty_node;
+  links[node].next = empty_node;
+  links[node].leaf = true;
   empty_node = node;
   --count;
 }
 
-void Tree::insert_node(unsigned int node, unsigned int &target) {
-  if (nodes[target].is_leaf()) {
-    // Terget is leaf, simply split
-    auto branch = alloc_node();
-    // Make it branch
-    if (auto grandparent = nodes[target].parent; grandparent != NULL_NODE) {
-      nodes[branch].parent = grandparent;
-      (nodes[grandparent].left == target ? nodes[grandparent].left
-                                         : nodes[grandparent].right) = branch;
+Tree::Slot Tree::slot(unsigned int parent, int side) const {
+  auto &current = children[parent];
+  return {current.node[side], current.corners(side), current.height[side]};
+}
+
+Tree::Slot Tree::slot(unsigned int node) const {
+  if (node == root)
+    return root_slot();
+  auto parent = links[node].parent;
+  return slot(parent, children[parent].node[0] == node ? 0 : 1);
+}
+
+Tree::Slot Tree::root_slot() const {
+  if (is_leaf(root))
+    return {root, Corners{root_fatten}, 0};
+  auto &current = children[root];
+  return {root, Corners{root_fatten},
+          1 + std::max(current.height[0], current.height[1])};
+}
+
+// Slot of a branch as computed from its children
+Tree::Slot Tree::refit(unsigned int branch) const {
+  auto &current = children[branch];
+  return {branch, current.corners(0).unite(current.corners(1)),
+          1 + std::max(current.height[0], current.height[1])};
+}
+
+Corners Tree::leaf_fatten(unsigned int node) const {
+  auto &aabb = bounds[node];
+  auto max = aabb.pos + aabb.dim;
+  return {aabb.pos.x - margin, aabb.pos.y - margin, -max.x - margin,
+          -max.y - margin};
+}
+
+// Makes left and right the children of branch
+void Tree::link(unsigned int branch, const Slot &left, const Slot &right) {
+  links[branch].leaf = false;
+  children[branch].node[0] = left.node;
+  children[branch].node[1] = right.node;
+  links[left.node].parent = branch;
+  links[right.node].parent = branch;
+  store(branch, left);
+  store(branch, right);
+}
+
+// Puts slot `to` in place of the child `from` of parent
+void Tree::relink(unsigned int parent, unsigned int from, const Slot &to) {
+  auto &current = children[parent];
+  current.node[current.node[0] == from ? 0 : 1] = to.node;
+  links[to.node].parent = parent;
+  store(parent, to);
+}
+
+// Writes the fat AABB and height of a child into the packed block of its
+// parent, the root's fat AABB is kept aside. Returns false when the block
+// already held the box, then no box above the parent changes either, only
+// heights may.
+bool Tree::store(unsigned int parent, const Slot &slot) {
+  if (parent == NULL_NODE) {
+    root_fatten = slot.fatten.box();
+    return true;
+  }
+  auto &current = children[parent];
+  auto side = current.node[0] == slot.node ? 0 : 1;
+  auto &box = slot.fatten;
+  auto changed = current.lo[side * 2] != box.x ||
+                 current.lo[side * 2 + 1] != box.y ||
+                 current.hi[side * 2] != box.nx ||
+                 current.hi[side * 2 + 1] != box.ny;
+  current.lo[side * 2] = box.x;
+  current.lo[side * 2 + 1] = box.y;
+  current.hi[side * 2] = box.nx;
+  current.hi[side * 2 + 1] = box.ny;
+  current.height[side] = slot.height;
+  return changed;
+}
+
+// Picks the sibling by surface area heuristic (perimeter in 2D): going down
+// a level only pays off while it is cheaper than pairing with the current
+// node, then rotates the ancestors on the way back up until one keeps its
+// box. The search starts at start, or at the root for NULL_NODE.
+void Tree::insert_node(unsigned int node, unsigned int start) {
+  Slot leaf{node, leaf_fatten(node), 0};
+  if (root == NULL_NODE) {
+    root = node;
+    links[node].parent = NULL_NODE;
+    root_fatten = leaf.fatten.box();
+    return;
+  }
+
+  auto target = start == NULL_NODE ? root_slot() : slot(start);
+  while (target.height > 0) {
+    auto &current = children[target.node];
+    auto combined = target.fatten.unite(leaf.fatten).perimeter();
+    // Cost of a new parent for target and leaf
+    auto cost = 2 * combined;
+    // Growth of target's box that every deeper choice has to pay as well
+    auto inheritance = 2 * (combined - target.fatten.perimeter());
+
+    float child_cost[2];
+    for (auto i = 0; i < 2; ++i) {
+      auto box = current.corners(i);
+      child_cost[i] = box.unite(leaf.fatten).perimeter() + inheritance;
+      if (!current.leaf(i))
+        child_cost[i] -= box.perimeter();
     }
-    nodes[branch].left = node;
-    nodes[branch].right = target;
-    nodes[node].parent = branch;
-    nodes[target].parent = branch;
-    target = branch; // in case of root node - change it
+    if (cost < child_cost[0] && cost < child_cost[1])
+      break;
+
+    target = slot(target.node, child_cost[0] < child_cost[1] ? 0 : 1);
+  }
+
+  auto parent = links[target.node].parent;
+  auto branch = alloc_node();
+  link(branch, leaf, target);
+  if (parent != NULL_NODE) {
+    relink(parent, target.node, refit(branch));
   } else {
-    // Target is branch
-    auto left = nodes[target].left;
-    auto right = nodes[target].right;
-    auto area_diff0 = nodes[left].aabb.unite(nodes[node].aabb).area() -
-                      nodes[left].aabb.area();
-    auto area_diff1 = nodes[right].aabb.unite(nodes[node].aabb).area() -
-                      nodes[right].aabb.area();
-
-    // Insert to the child that gives less area increase
-    if (area_diff0 < area_diff1) {
-      insert_node(node, left);
-    } else {
-      insert_node(node, right);
+    root = branch; // in case of root node - change it
+    links[branch].parent = NULL_NODE;
+    root_fatten = refit(branch).fatten.box();
+  }
+
+  // Propagates back up while the boxes grow, then only the heights
+  for (auto current = parent, below = branch; current != NULL_NODE;
+       below = current, current = links[current].parent) {
+    rotate(current, children[current].node[0] == below ? 0 : 1);
+    if (!store(links[current].parent, refit(current))) {
+      raise(links[current].parent);
+      break;
     }
   }
-  // Propagates back up the recursion stack
-  update_node(target, margin);
 }
 
+// Leaves move little between updates, so the search for the new sibling
+// starts from the lowest former ancestor that still holds the fat AABB
+void Tree::reinsert(unsigned int node) {
+  auto start = pull_node(node);
+  auto fatten = leaf_fatten(node);
+  while (start != NULL_NODE && !slot(start).fatten.contains(fatten))
+    start = links[start].parent;
+  insert_node(node, start);
+}
+
+// No insertion follows to refit the ancestors, so they shrink here up to the
+// first that keeps its box. Otherwise they would keep holding the leaf.
 void Tree::remove_node(unsigned int node) {
-  if (node != root) {
-    pull_node(node);
-    free_node(nodes[node].parent);
+  for (auto current = pull_node(node); current != NULL_NODE;
+       current = links[current].parent) {
+    if (!store(links[current].parent, refit(current)))
+      break;
   }
   free_node(node);
 }
 
-void Tree::pull_node(unsigned int node) {
-  assert(nodes[node].is_leaf());
+// Returns the branch the sibling of node moved up to, NULL_NODE when that
+// is the root or the tree is left empty
+unsigned int Tree::pull_node(unsigned int node) {
+  assert(is_leaf(node));
   if (node == root) {
     root = NULL_NODE;
   } else {
-    auto parent = nodes[node].parent;
-    auto sibling =
-        nodes[parent].left == node ? nodes[parent].right : nodes[parent].left;
-    auto grandparent = nodes[parent].parent;
-    if (grandparent != NULL_NODE) { // if there's a grandparent
-      nodes[sibling].parent = grandparent;
-      (nodes[grandparent].left == parent ? nodes[grandparent].left
-                                         : nodes[grandparent].right) = sibling;
-    } else { // no grandparent
-      root = sibling;
-      nodes[sibling].parent = NULL_NODE;
-    }
+    auto parent = links[node].parent;
+    auto sibling = slot(parent, children[parent].node[0] == node ? 1 : 0);
+    auto grandparent = links[parent].parent;
+    links[node].parent = NULL_NODE;
     free_node(parent);
+    if (grandparent == NULL_NODE) {
+      root = sibling.node;
+      root_fatten = sibling.fatten.box();
+      links[sibling.node].parent = NULL_NODE;
+      return NULL_NODE;
+    }
+    relink(grandparent, parent, sibling);
+
+    // The ancestors keep their boxes, which still hold the leaf and so only
+    // become loose. The reinsertion that follows in update() refits and
+    // rotates the ones it passes, and starts lower the more of them hold
+    // the leaf. remove_node shrinks them itself.
+    raise(grandparent);
+    return grandparent;
   }
+  return NULL_NODE;
 }
 
-void Tree::update_node(unsigned int node, float margin) {
-  if (nodes[node].is_leaf()) {
-    nodes[node].fatten.pos = nodes[node].aabb.pos - geom::Vector(margin);
-    nodes[node].fatten.dim = nodes[node].aabb.dim + geom::Vector(margin * 2);
-  } else {
-    auto left = nodes[node].left;
-    auto right = nodes[node].right;
-    nodes[node].aabb = nodes[left].aabb.unite(nodes[right].aabb);
-    nodes[node].fatten = nodes[left].fatten.unite(nodes[right].fatten);
+// Brings the heights above branch up to date, up to the first ancestor that
+// keeps its height
+void Tree::raise(unsigned int branch) {
+  for (auto current = branch;
+       current != NULL_NODE && links[current].parent != NULL_NODE;
+       current = links[current].parent) {
+    auto &block = children[current];
+    auto &above = children[links[current].parent];
+    auto &height = above.height[above.node[0] == current ? 0 : 1];
+    auto fit = 1 + std::max(block.height[0], block.height[1]);
+    if (height == fit)
+      break;
+    height = fit;
   }
 }
 
-void Tree::check_nodes(unsigned int node,
-                       std::vector<unsigned int> &invalid_nodes) {
-  if (nodes[node].is_leaf()) {
-    if (!nodes[node].is_valid()) {
-      invalid_nodes.push_back(node);
+// Swaps the child of node opposite to from with a grandchild under from
+// when that shrinks the perimeter of the branch in between. Only the side a
+// refit came up from is tried, its block was just read. The box of node
+// itself stays the same, so only the heights above it may change.
+void Tree::rotate(unsigned int node, int from) {
+  auto &current = children[node];
+  if (current.leaf(from))
+    return;
+  auto side = 1 - from;
+  auto box = current.corners(side);
+  auto sibling = current.corners(from);
+  auto &other = children[current.node[from]];
+  auto best = 0.0f;
+  auto grandchild = -1;
+  for (auto j = 0; j < 2; ++j) {
+    auto cost =
+        box.unite(other.corners(1 - j)).perimeter() - sibling.perimeter();
+    if (cost < best) {
+      best = cost;
+      grandchild = j;
+    }
+  }
+  if (grandchild < 0)
+    return;
+
+  auto moved = slot(node, side);
+  auto branch = current.node[from];
+  auto lifted = slot(branch, grandchild);
+  relink(node, moved.node, lifted);
+  relink(branch, lifted.node, moved);
+  store(node, refit(branch));
+}
+
+int Tree::height() const {
+  return root == NULL_NODE ? 0 : root_slot().height;
+}
+
+int Tree::max_balance() const {
+  auto result = 0;
+  each([&](unsigned int node) {
+    if (!is_leaf(node)) {
+      auto &current = children[node];
+      result =
+          std::max(result, std::abs(current.height[1] - current.height[0]));
+    }
+  });
+  return result;
+}
+
+float Tree::area_ratio() const {
+  if (root == NULL_NODE)
+    return 0;
+  auto total = 0.0f;
+  each([&](unsigned int node) {
+    if (!is_leaf(node))
+      total += fatten(node).perimeter();
+  });
+  return total / root_fatten.perimeter();
+}
+
+TreeStats Tree::take_stats() {
+  auto leaves = (count + 1) / 2; // every branch has two children
+  TreeStats stats{height(),
+                  leaves,
+                  count - leaves,
+                  capacity,
+                  grows,
+                  reinserted,
+                  queries.exchange(0, std::memory_order_relaxed),
+                  visited.exchange(0, std::memory_order_relaxed),
+                  hits.exchange(0, std::memory_order_relaxed),
+                  pairs.exchange(0, std::memory_order_relaxed)};
+  grows = 0;
+  reinserted = 0;
+  return stats;
+}
+
+void write_csv(std::ostream &out, const TreeStats &stats) {
+  out << stats.height << ',' << stats.leaves << ',' << stats.branches << ','
+      << stats.capacity << ',' << stats.grows << ',' << stats.reinserted << ','
+      << stats.queries << ',' << stats.visited << ',' << stats.hits << ','
+      << stats.pairs;
+}
+
+// Collects leaves that left their fat AABB. Leaves are checked against the
+// packed copy in their parent, so only the hot arrays are read, and the
+// branches in pool order rather than down the tree. Free nodes count as
+// leaves.
+void Tree::check_nodes(std::vector<unsigned int> &invalid_nodes) {
+  for (auto branch = 0u; branch < capacity; ++branch) {
+    if (links[branch].leaf)
+      continue;
+    auto &current = children[branch];
+    for (auto i = 0; i < 2; ++i) {
+      auto child = current.node[i];
+      if (current.leaf(i) && !current.corners(i).contains(bounds[child]))
+        invalid_nodes.push_back(child);
     }
-  } else {
-    check_nodes(nodes[node].left, invalid_nodes);
-    check_nodes(nodes[node].right, invalid_nodes);
   }
 }
 
-} // namespace aabb
\ No newline at end of file
+} // namespace aabb
@@ -3,9 +3,19 @@
 
 #include <entt/entt.hpp>
 
+#include <atomic>
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
 #include "Geometry.hpp"
 
 constexpr unsigned int NULL_NODE = 0xFFFFFFFF;
@@ -23,83 +33,341 @@ public:
   AABB unite(const AABB &) const;
   AABB overlap(const AABB &) const;
   bool contains(const AABB &) const;
+  bool contains(const geom::Point<float> &) const;
   bool overlaps(const AABB &) const;
-  unsigned int area();
+  unsigned int area() const;
+  float perimeter() const;
 
 private:
 };
 
-struct Node {
-  Node();
+// Box in the layout of Children: min corner, then negated max corner. The
+// union of two is the lane-wise minimum, so refits and rotations never go
+// back to the position and size of an AABB.
+struct Corners {
+  Corners(float x, float y, float nx, float ny);
+  explicit Corners(const AABB &aabb);
+  float x, y;
+  float nx, ny;
+  AABB box() const;
+  Corners unite(const Corners &) const;
+  bool contains(const AABB &) const;
+  bool contains(const Corners &) const;
+  bool overlaps(const Corners &) const;
+  float perimeter() const;
+};
+
+// Fat AABBs of both children of a branch, laid out so that one SIMD compare
+// against a Probe tests them together: lo holds the min corners and hi the
+// negated max corners, left child first. Heights of the children are kept
+// next to them, a leaf has height 0.
+struct alignas(16) Children {
+  float lo[4];
+  float hi[4];
+  unsigned int node[2];
+  int height[2];
 
-  entt::entity id;
+  AABB box(int side) const;
+  Corners corners(int side) const;
+  bool leaf(int side) const { return height[side] == 0; }
+};
+
+// Query box in the Children layout: max corners in lo, negated min corners
+// in hi, repeated for both children. Only 16 byte aligned, so the AVX path
+// reads it unaligned.
+struct alignas(16) Probe {
+  Probe(const AABB &aabb);
+  float lo[4];
+  float hi[4];
+};
 
-  AABB aabb;
-  AABB fatten;
+// Bit 0 is set when the left child overlaps the probe, bit 1 for the right
+inline unsigned int overlap_mask(const Children &children, const Probe &probe) {
+#if defined(__AVX__)
+  auto lanes = _mm256_cmp_ps(_mm256_loadu_ps(children.lo),
+                             _mm256_loadu_ps(probe.lo), _CMP_LT_OQ);
+  auto mask = (unsigned int)_mm256_movemask_ps(lanes);
+  mask &= mask >> 4;
+#elif defined(__SSE2__) || defined(_M_X64)
+  auto lo = _mm_cmplt_ps(_mm_load_ps(children.lo), _mm_load_ps(probe.lo));
+  auto hi = _mm_cmplt_ps(_mm_load_ps(children.hi), _mm_load_ps(probe.hi));
+  auto mask = (unsigned int)_mm_movemask_ps(_mm_and_ps(lo, hi));
+#else
+  auto mask = 0u;
+  for (auto i = 0; i < 4; ++i) {
+    if (children.lo[i] < probe.lo[i] && children.hi[i] < probe.hi[i])
+      mask |= 1u << i;
+  }
+#endif
+  return ((mask & 0x3) == 0x3) | (((mask & 0xC) == 0xC) << 1);
+}
 
-  unsigned int next;
+// Cold per-node data, only touched when the tree changes shape. Free nodes
+// are leaves.
+struct Links {
   unsigned int parent;
-  unsigned int left;
-  unsigned int right;
-
-  bool is_leaf() const;
-  bool is_valid();
-  void set_leaf(const AABB &aabb);
-  void set_branch(unsigned int left, unsigned int right);
-  void update_AABB(float margin);
+  unsigned int next;
+  bool leaf = true;
+};
+
+// First leaf met by a ray or a moving box: t is the fraction of the move
+// done until they touch and normal the side of the leaf that was hit.
+// node is NULL_NODE on a miss.
+struct RayHit {
+  unsigned int node;
+  float t;
+  geom::Vector<float> normal;
 };
 
-// TODO: add iteration support
+// Pairs of overlapping leaf nodes
+using PairList = std::vector<std::pair<unsigned int, unsigned int>>;
+
+// Health of a tree, for tuning the margin and seeing when it degrades. The
+// shape is read when the stats are taken, counters are summed since the
+// previous take.
+struct TreeStats {
+  int height;
+  unsigned int leaves, branches, capacity;
+  std::uint64_t grows;      // doublings of the node pool
+  std::uint64_t reinserted; // leaves moved out of their fat AABB by update()
+  std::uint64_t queries;    // region and point queries
+  std::uint64_t visited;    // nodes tested by those queries
+  std::uint64_t hits;       // leaves they reported
+  std::uint64_t pairs;      // pairs reported by overlaps()
+};
+
+// Header of the rows written by write_csv
+constexpr auto TREE_STATS_CSV = "height,leaves,branches,capacity,grows,"
+                                "reinserted,queries,visited,hits,pairs";
+void write_csv(std::ostream &out, const TreeStats &stats);
+
+// Nodes are stored as parallel arrays: hot bounds (tight leaf AABBs and the
+// packed child boxes of branches) apart from cold links and payload. Fat
+// AABBs live only in the parent's packed boxes, the root's is kept aside.
 class Tree {
 public:
   Tree(float margin, unsigned int capacity);
   ~Tree(){};
 
   unsigned int add(entt::entity id, const AABB &aabb);
+  // Adds many leaves at once by binned SAH, much faster than one add per
+  // leaf. Returns the leaf nodes in the order of the input.
+  std::vector<unsigned int>
+  build(const std::vector<std::pair<entt::entity, AABB>> &leaves);
   void remove(unsigned int node);
   void update();
+  // Refits only the given leaves, when the others are known not to move
+  void update(const std::vector<unsigned int> &moved);
   void print();
-  inline unsigned int size() { return count; };
+  inline unsigned int size() const { return count; };
   std::vector<entt::entity> query(unsigned int node) const;
-  std::vector<std::pair<unsigned int, unsigned int>> overlaps() const;
-  // ColliderPairList &ComputePairs();
-  // Collider *Pick(const Vec3 &point) const;
-  // Query(const AABB &aabb, ColliderList &out) const;
-  // RayCastResult RayCast(const Ray3 &ray) const;
+  std::size_t query(const AABB &aabb, std::vector<entt::entity> &out) const;
+  entt::entity pick(const geom::Point<float> &point) const;
+  PairList overlaps() const;
+  void overlaps(PairList &result) const;
+  // First leaf on the segment from origin to origin + delta. Children are
+  // entered nearest first and anything past the best hit is skipped.
+  RayHit ray_cast(const geom::Point<float> &origin,
+                  const geom::Vector<float> &delta) const;
+  // First leaf the box touches when moved by delta, as the ray of its
+  // corner against the leaves grown by its size. Leaves it already
+  // overlaps are left to the overlap tests.
+  RayHit sweep(const AABB &aabb, const geom::Vector<float> &delta) const;
 
-  const Node &operator[](const unsigned int i) const { return nodes[i]; }
-  Node &operator[](const unsigned int i) { return nodes[i]; }
+  // Quality metrics: height of the root (0 for a single leaf), the biggest
+  // height difference between siblings and the summed perimeter of all
+  // branches relative to the root's one
+  int height() const;
+  int max_balance() const;
+  float area_ratio() const;
 
-private:
-  // typedef std::vector<Node *> NodeList;
-  // using NodeList = std::vector<Node>;
+  // Query counters cost an atomic add per query, so they are off by default
+  void count_work(bool enabled) { counting = enabled; };
+  // Current shape and the counters since the last take, which are reset
+  TreeStats take_stats();
+
+  // Tight AABB of a leaf, moving the body means moving this one
+  AABB &aabb(unsigned int node) { return bounds[node]; }
+  const AABB &aabb(unsigned int node) const { return bounds[node]; }
+  AABB fatten(unsigned int node) const;
+  entt::entity id(unsigned int node) const { return ids[node]; }
+  bool is_leaf(unsigned int node) const { return links[node].leaf; }
+
+  // Visits every node of the tree, parents before children
+  template <typename Visitor> void each(Visitor &&visitor) const {
+    if (root == NULL_NODE)
+      return;
+    auto &stack = scratch();
+    auto base = stack.size();
+    stack.push_back(root);
+    while (stack.size() > base) {
+      auto current = stack.back();
+      stack.pop_back();
+      visitor(current);
+      if (!is_leaf(current)) {
+        stack.push_back(children[current].node[1]);
+        stack.push_back(children[current].node[0]);
+      }
+    }
+  }
+
+  // Visitors take a leaf node index and may return false to stop the search.
+  // Without an explicit stack a thread local scratch one is used, nested
+  // queries from inside a visitor are fine either way.
+  template <typename Visitor>
+  void query(const AABB &aabb, Visitor &&visitor) const {
+    query(aabb, visitor, scratch());
+  }
+  template <typename Visitor>
+  void query(const AABB &aabb, Visitor &&visitor,
+             std::vector<unsigned int> &stack) const {
+    traverse(
+        aabb, [&](const AABB &box) { return box.overlaps(aabb); }, visitor,
+        stack);
+  }
+  template <typename Visitor>
+  void pick(const geom::Point<float> &point, Visitor &&visitor) const {
+    pick(point, visitor, scratch());
+  }
+  template <typename Visitor>
+  void pick(const geom::Point<float> &point, Visitor &&visitor,
+            std::vector<unsigned int> &stack) const {
+    traverse(
+        point_box(point), [&](const AABB &box) { return box.contains(point); },
+        visitor, stack);
+  }
 
+private:
   unsigned int root;
 
   float margin;
 
-  std::vector<Node> nodes;
+  AABB root_fatten;
+  std::vector<AABB> bounds;
+  std::vector<Children> children;
+  std::vector<Links> links;
+  std::vector<entt::entity> ids;
 
   unsigned int count;
   unsigned int capacity;
   unsigned int empty_node;
+  // Leaves out of their fat AABB, kept between updates for the capacity
+  std::vector<unsigned int> escaped;
+
+  // Counters of TreeStats, queries may run on several threads at once
+  bool counting = false;
+  std::uint64_t grows = 0;
+  std::uint64_t reinserted = 0;
+  mutable std::atomic<std::uint64_t> queries{0}, visited{0}, hits{0}, pairs{0};
+
+  // Work of one query, added to the counters when it goes out of scope
+  struct QueryCount {
+    const Tree &tree;
+    unsigned int visited = 0;
+    unsigned int hits = 0;
+    ~QueryCount() {
+      if (tree.counting) {
+        tree.queries.fetch_add(1, std::memory_order_relaxed);
+        tree.visited.fetch_add(visited, std::memory_order_relaxed);
+        tree.hits.fetch_add(hits, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  // Contents of a child slot in a branch
+  struct Slot {
+    unsigned int node;
+    Corners fatten;
+    int height;
+  };
+
+  static std::vector<unsigned int> &scratch();
+  static std::vector<std::pair<unsigned int, float>> &cast_scratch();
+  static AABB point_box(const geom::Point<float> &point);
+
+  // Ray and sweep casts, leaves the box starts in are hit at 0 with inside
+  // and skipped without
+  RayHit cast(const AABB &aabb, const geom::Vector<float> &delta,
+              bool inside) const;
+
+  // Depth-first walk: branches are pruned by the fat AABBs of both children
+  // at once, leaves are tested by the tight one. Only the part of the stack
+  // above its initial size is used.
+  template <typename Test, typename Visitor>
+  void traverse(const AABB &aabb, Test &&test, Visitor &&visitor,
+                std::vector<unsigned int> &stack) const {
+    if (root == NULL_NODE)
+      return;
+    QueryCount work{*this};
+    ++work.visited;
+    if (is_leaf(root)) {
+      if (test(bounds[root])) {
+        ++work.hits;
+        visit(visitor, root);
+      }
+      return;
+    }
+    if (!root_fatten.overlaps(aabb))
+      return;
+
+    Probe probe{aabb};
+    auto base = stack.size();
+    stack.push_back(root);
+    while (stack.size() > base) {
+      auto &current = children[stack.back()];
+      stack.pop_back();
+      ++work.visited;
+      auto mask = overlap_mask(current, probe);
+      for (auto i = 0; i < 2; ++i) {
+        if (!(mask & (1u << i)))
+          continue;
+        auto child = current.node[i];
+        if (!current.leaf(i)) {
+          stack.push_back(child);
+        } else if (test(bounds[child])) {
+          ++work.hits;
+          if (!visit(visitor, child)) {
+            stack.resize(base);
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  template <typename Visitor>
+  static bool visit(Visitor &&visitor, unsigned int node) {
+    if constexpr (std::is_same_v<std::invoke_result_t<Visitor, unsigned int>,
+                                 bool>) {
+      return visitor(node);
+    } else {
+      visitor(node);
+      return true;
+    }
+  }
 
   unsigned int alloc_node();
   void free_node(unsigned int node);
 
-  void insert_node(unsigned int node, unsigned int &target);
+  Slot slot(unsigned int parent, int side) const;
+  Slot slot(unsigned int node) const;
+  Slot root_slot() const;
+  Slot refit(unsigned int branch) const;
+  Corners leaf_fatten(unsigned int node) const;
+  void link(unsigned int branch, const Slot &left, const Slot &right);
+  void relink(unsigned int parent, unsigned int from, const Slot &to);
+  bool store(unsigned int parent, const Slot &slot);
+
+  unsigned int split(unsigned int *begin, unsigned int *end) const;
+  void insert_node(unsigned int node, unsigned int start = NULL_NODE);
+  void reinsert(unsigned int node);
   void remove_node(unsigned int node);
-  void pull_node(unsigned int node);
-  void update_node(unsigned int node, float margin);
-  void check_nodes(unsigned int node, std::vector<unsigned int> &invalid_nodes);
-  void get_overlaps(unsigned int n0, unsigned int n1,
-                    std::vector<std::pair<unsigned int, unsigned int>> &result,
-                    std::vector<bool> &checked) const;
-  void get_overlaps(unsigned int node,
-                    std::vector<std::pair<unsigned int, unsigned int>> &result,
-                    std::vector<bool> &checked) const;
+  unsigned int pull_node(unsigned int node);
+  void raise(unsigned int branch);
+  void rotate(unsigned int node, int from);
+  void check_nodes(std::vector<unsigned int> &invalid_nodes);
 };
 
 } // namespace aabb
 
-#endif // AABB_H
\ No newline at end of file
+#endif // AABB_H
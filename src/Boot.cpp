@@ -0,0 +1,60 @@
+#include <algorithm>
+#include <iomanip>
+#include <thread>
+
+#include "Boot.hpp"
+#include "Jobs.hpp"
+#include "Profiler.hpp"
+
+std::vector<Layer> decode_level(Render &render, const std::string &sheet,
+                                const std::vector<std::string> &paths,
+                                BootTimes &times) {
+  using clock = std::chrono::steady_clock;
+  times.start = clock::now();
+  times.images.assign(paths.size() + 1, {});
+  std::vector<Layer> level(paths.size());
+  SDL_Surface *image = nullptr;
+  {
+    PROFILE_SCOPE("decode_level");
+    // Image number 0 is the sheet, one thread each up to the cores
+    auto count = (unsigned int)paths.size() + 1;
+    Jobs jobs{std::min(count, std::thread::hardware_concurrency())};
+    jobs.parallel_for(count, [&](auto begin, auto end, auto) {
+      for (auto i = begin; i < end; ++i) {
+        auto start = clock::now();
+        if (i == 0)
+          image = IMG_Load(sheet.c_str());
+        else
+          level[i - 1] = read_layer(paths[i - 1]);
+        times.images[i] = {i == 0 ? sheet : paths[i - 1],
+                           clock::now() - start};
+      }
+    });
+  }
+  times.decode = clock::now() - times.start;
+
+  auto start = clock::now();
+  render.load_sheet(image);
+  SDL_FreeSurface(image);
+  times.upload = clock::now() - start;
+  return level;
+}
+
+void print_boot(std::ostream &out, const BootTimes &times,
+                const LoadTimes &load) {
+  auto ms = [](std::chrono::nanoseconds time) {
+    return std::chrono::duration<double, std::milli>(time).count();
+  };
+  auto flags = out.flags();
+  out << std::fixed << std::setprecision(1)
+      << "boot:      " << ms(std::chrono::steady_clock::now() - times.start)
+      << " ms\n"
+      << "  decode:  " << ms(times.decode) << " ms\n";
+  for (auto &[path, time] : times.images)
+    out << "    " << path << ": " << ms(time) << " ms\n";
+  out << "  upload:  " << ms(times.upload) << " ms\n"
+      << "  scan:    " << ms(load.scan) << " ms\n"
+      << "  spawn:   " << ms(load.spawn) << " ms\n"
+      << "  trees:   " << ms(load.trees) << " ms\n";
+  out.flags(flags);
+}
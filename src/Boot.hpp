@@ -0,0 +1,41 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "Render.hpp"
+
+#endif
+
+#include "World.hpp"
+
+// Wall time of the startup stages that run before the world is built
+struct BootTimes {
+  std::chrono::steady_clock::time_point start;
+  std::chrono::nanoseconds decode{0}; // all images, decoded side by side
+  std::chrono::nanoseconds upload{0}; // sprite sheet texture
+  // Decode time of every image on its own thread
+  std::vector<std::pair<std::string, std::chrono::nanoseconds>> images;
+};
+
+// Decodes the sprite sheet and the layer images at once on worker threads,
+// then uploads the sheet from the calling thread, which owns the renderer.
+// The render has to exist first, it initializes the image loaders. Images
+// that can't be read come out empty, as from read_layer.
+std::vector<Layer> decode_level(Render &render, const std::string &sheet,
+                                const std::vector<std::string> &paths,
+                                BootTimes &times);
+
+// Where the time went from the start of decode_level until now, with the
+// stages of building the world
+void print_boot(std::ostream &out, const BootTimes &times,
+                const LoadTimes &load);
+
+#endif // BOOT_H
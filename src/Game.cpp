@@ -3,43 +3,50 @@
 #include <entt/entt.hpp>
 
 #include "Game.hpp"
+#include "Pacer.hpp"
 
 void Game::run() {
   using namespace std::chrono;
 
-  auto previous = high_resolution_clock::now();
-  auto timer = high_resolution_clock::now();
+  Pacer pacer{TICKS_PER_SEC, render.refresh_rate(), MAX_TICKS_PER_FRAME};
+  auto timer = steady_clock::now();
   auto ticks = 0;
   auto frames = 0;
-  auto delta = 0.0;
 
   // Enter the main loop. Press x to exit.
   while (!SDL_HasEvent(SDL_QUIT)) {
-    auto current = high_resolution_clock::now();
-    delta +=
-        duration_cast<nanoseconds>(current - previous).count() * TICKS_PER_NSEC;
-
-    for (previous = current; delta >= 1.0; --delta) {
+    for (auto due = pacer.ticks(); due > 0; --due) {
       SDL_FlushEvents(SDL_FIRSTEVENT, SDL_LASTEVENT);
       SDL_PumpEvents();
-      world.update(render);
+      // Cached chunk textures lose their content on these
+      if (SDL_HasEvents(SDL_RENDER_TARGETS_RESET, SDL_RENDER_DEVICE_RESET))
+        render.reset_chunks();
+      world.handle_input();
+      world.update();
       ticks++;
     }
 
-    // SDL_Delay(10);
-
+    // Frames follow the display rather than the ticks, so they are drawn
+    // between the last two ticks by the time left over
+    world.render(render, pacer.alpha());
     if (render.updated) {
       render.present();
       render.updated = false;
       frames++;
     }
 
-    if (current - timer >= seconds{1}) {
+    if (steady_clock::now() - timer >= seconds{1}) {
+      auto &stats = render.stats();
       render.set_title("ticks: " + std::to_string(ticks) +
-                       "; frames: " + std::to_string(frames));
+                       "; frames: " + std::to_string(frames) +
+                       "; draws: " + std::to_string(stats.draw_calls) +
+                       "; quads: " + std::to_string(stats.quads) +
+                       "; dropped: " + std::to_string(pacer.dropped()));
       timer += seconds{1};
       ticks = 0;
       frames = 0;
     }
+
+    pacer.wait();
   }
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
+#include <iostream>
 #include <string>
+#include <thread>
 
 #ifndef RENDER_H
 #define RENDER_H
@@ -6,23 +8,39 @@
 #include "Render.hpp"
 
 #endif
+#include "Boot.hpp"
+#include "Level.hpp"
 #include "World.hpp"
 
 constexpr auto WINDOW_WIDTH = 640;
 constexpr auto WINDOW_HEIGHT = 480;
 
 constexpr auto TICKS_PER_SEC = 60;
-constexpr auto TICKS_PER_NSEC = TICKS_PER_SEC / 1e9;
+// Catch-up ticks run before a frame, the rest are dropped
+constexpr auto MAX_TICKS_PER_FRAME = 5;
 
 class Game {
 public:
+  // Images are decoded together and the layers scanned in parallel, the
+  // boot stages are reported on stdout
   Game(const std::string &title, const std::string &sprite_path,
        const std::initializer_list<std::string> level_layers)
-      : render{WINDOW_WIDTH, WINDOW_HEIGHT, title, sprite_path},
-        world{level_layers} {};
+      : render{WINDOW_WIDTH, WINDOW_HEIGHT, title},
+        world{decode_level(render, sprite_path, level_layers, boot),
+              std::thread::hardware_concurrency()} {
+    print_boot(std::cout, boot, world.load_times());
+  };
+  // Streams the level around the player, it has to outlive the game
+  Game(const std::string &title, const std::string &sprite_path,
+       const LevelFile &level)
+      : render{WINDOW_WIDTH, WINDOW_HEIGHT, title},
+        world{level, true, std::thread::hardware_concurrency()} {
+    decode_level(render, sprite_path, {}, boot);
+  };
   void run();
 
 private:
   Render render;
+  BootTimes boot;
   World world;
 };
\ No newline at end of file
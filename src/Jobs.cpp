@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include "Jobs.hpp"
+#include "Profiler.hpp"
+
+Jobs::Jobs(unsigned int threads) { start(threads); }
+
+Jobs::~Jobs() { stop(); }
+
+void Jobs::start(unsigned int threads) {
+  stop();
+  ranges = std::vector<Range>(std::max(threads, 1u));
+  stopping = false;
+  for (auto i = 1u; i < ranges.size(); ++i)
+    workers.emplace_back(&Jobs::work, this, i);
+}
+
+void Jobs::stop() {
+  {
+    std::lock_guard lock{mutex};
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto &worker : workers)
+    worker.join();
+  workers.clear();
+}
+
+std::size_t Jobs::chunks(std::size_t count) const {
+  if (deterministic)
+    return (count + grain - 1) / grain;
+  return std::min<std::size_t>(count, ranges.size() * 4);
+}
+
+void Jobs::run(std::size_t total, void *context,
+               void (*call)(void *, std::size_t)) {
+  // Ranges are filled under their locks, so whoever takes a chunk also
+  // sees the task it belongs to
+  this->context = context;
+  this->call = call;
+  remaining = total;
+  auto count = ranges.size();
+  for (auto i = 0u; i < count; ++i) {
+    std::lock_guard lock{ranges[i].mutex};
+    ranges[i].begin = total * i / count;
+    ranges[i].end = total * (i + 1) / count;
+  }
+  {
+    std::lock_guard lock{mutex};
+    ++generation;
+  }
+  wake.notify_all();
+
+  drain(0);
+  std::unique_lock lock{mutex};
+  done.wait(lock, [&] { return remaining == 0; });
+}
+
+void Jobs::work(unsigned int self) {
+  auto seen = 0u;
+  for (;;) {
+    {
+      std::unique_lock lock{mutex};
+      wake.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+    drain(self);
+  }
+}
+
+void Jobs::drain(unsigned int self) {
+  std::size_t chunk;
+  while (take(self, chunk) || steal(self, chunk)) {
+    {
+      PROFILE_SCOPE("Jobs::chunk");
+      call(context, chunk);
+    }
+    if (--remaining == 0) {
+      std::lock_guard lock{mutex};
+      done.notify_one();
+    }
+  }
+}
+
+bool Jobs::take(unsigned int self, std::size_t &chunk) {
+  auto &range = ranges[self];
+  std::lock_guard lock{range.mutex};
+  if (range.begin == range.end)
+    return false;
+  chunk = range.begin++;
+  return true;
+}
+
+bool Jobs::steal(unsigned int self, std::size_t &chunk) {
+  for (auto i = 1u; i < ranges.size(); ++i) {
+    auto &range = ranges[(self + i) % ranges.size()];
+    std::lock_guard lock{range.mutex};
+    if (range.begin != range.end) {
+      chunk = --range.end;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,89 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join pool for data parallel loops. A loop is cut into chunks, every
+// thread starts on its own contiguous run of them and steals from the back
+// of the others' runs when it is done. The calling thread takes part.
+//
+// In deterministic mode chunk boundaries only depend on the element count,
+// so per-chunk results merged in chunk order don't change with the number
+// of threads. Otherwise there are a few chunks per thread.
+//
+// Callers pick the width, the default pool runs everything on the calling
+// thread and starts none.
+class Jobs {
+public:
+  explicit Jobs(unsigned int threads = 1);
+  ~Jobs();
+  Jobs(const Jobs &) = delete;
+  Jobs &operator=(const Jobs &) = delete;
+
+  // Restarts the pool, 0 or 1 runs everything on the calling thread
+  void start(unsigned int threads);
+  void stop();
+  unsigned int size() const { return (unsigned int)ranges.size(); };
+
+  bool deterministic = false;
+  std::size_t grain = 1024; // elements per chunk in deterministic mode
+
+  // Number of chunks a loop over count elements is cut into
+  std::size_t chunks(std::size_t count) const;
+
+  // Calls body(begin, end, chunk) for every chunk of [0, count) and returns
+  // once all are done. Not re-entrant.
+  template <typename Body> void parallel_for(std::size_t count, Body &&body) {
+    auto total = chunks(count);
+    if (total == 0)
+      return;
+    auto size = (count + total - 1) / total;
+    auto task = [&](std::size_t chunk) {
+      auto begin = chunk * size;
+      body(begin, std::min(begin + size, count), chunk);
+    };
+    if (workers.empty() || total == 1) {
+      for (auto chunk = 0u; chunk < total; ++chunk)
+        task(chunk);
+      return;
+    }
+    run(total, &task, [](void *context, std::size_t chunk) {
+      (*static_cast<decltype(task) *>(context))(chunk);
+    });
+  }
+
+private:
+  // Chunks left to one thread, taken from the front by the owner and from
+  // the back by thieves
+  struct Range {
+    std::mutex mutex;
+    std::size_t begin = 0, end = 0;
+  };
+
+  std::vector<std::thread> workers;
+  std::vector<Range> ranges; // the calling thread owns the first one
+
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  unsigned int generation = 0;
+  bool stopping = false;
+
+  void *context = nullptr;
+  void (*call)(void *, std::size_t) = nullptr;
+  std::atomic<std::size_t> remaining{0};
+
+  void run(std::size_t total, void *context,
+           void (*call)(void *, std::size_t));
+  void work(unsigned int self);
+  void drain(unsigned int self);
+  bool take(unsigned int self, std::size_t &chunk);
+  bool steal(unsigned int self, std::size_t &chunk);
+};
+
+#endif // JOBS_H
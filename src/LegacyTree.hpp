@@ -0,0 +1,239 @@
+#ifndef LEGACY_TREE_H
+#define LEGACY_TREE_H
+
+#include <cassert>
+#include <vector>
+
+#include "AABB.hpp"
+
+// Array-of-structures tree with one 56 byte Node per entry, kept only as a
+// baseline for bench_tree. Mirrors aabb::Tree before the node arrays split.
+namespace aabb::legacy {
+
+struct Node {
+  entt::entity id = entt::null;
+
+  AABB aabb{0, 0, 0, 0};
+  AABB fatten{0, 0, 0, 0};
+
+  unsigned int next = NULL_NODE;
+  unsigned int parent = NULL_NODE;
+  unsigned int left = NULL_NODE;
+  unsigned int right = NULL_NODE;
+
+  bool is_leaf() const { return left == NULL_NODE; }
+  bool is_valid() const { return fatten.contains(aabb); }
+};
+
+class Tree {
+public:
+  Tree(float margin, unsigned int capacity)
+      : root(NULL_NODE), margin(margin), count(0), capacity(capacity) {
+    nodes.resize(capacity);
+    for (auto i = 0u; i < capacity - 1; ++i) {
+      nodes[i].next = i + 1;
+    }
+    nodes[capacity - 1].next = NULL_NODE;
+    empty_node = 0;
+  }
+
+  unsigned int add(entt::entity id, const AABB &aabb) {
+    auto node = alloc_node();
+    nodes[node].id = id;
+    nodes[node].aabb = aabb;
+    update_node(node);
+    if (root == NULL_NODE) {
+      root = node;
+    } else {
+      insert_node(node, root);
+    }
+    return node;
+  }
+
+  void update() {
+    if (root == NULL_NODE)
+      return;
+    if (nodes[root].is_leaf()) {
+      update_node(root);
+      return;
+    }
+    std::vector<unsigned int> invalid_nodes;
+    invalid_nodes.reserve(64);
+    check_nodes(root, invalid_nodes);
+    for (auto &node : invalid_nodes) {
+      pull_node(node);
+      update_node(node);
+      insert_node(node, root);
+    }
+  }
+
+  template <typename Visitor>
+  void query(const AABB &aabb, Visitor &&visitor,
+             std::vector<unsigned int> &stack) const {
+    if (root == NULL_NODE)
+      return;
+    auto base = stack.size();
+    stack.push_back(root);
+    while (stack.size() > base) {
+      auto current = stack.back();
+      stack.pop_back();
+      if (nodes[current].is_leaf()) {
+        if (nodes[current].aabb.overlaps(aabb))
+          visitor(current);
+      } else if (nodes[current].fatten.overlaps(aabb)) {
+        stack.push_back(nodes[current].right);
+        stack.push_back(nodes[current].left);
+      }
+    }
+  }
+
+  void overlaps(PairList &result) const {
+    result.clear();
+    if (root == NULL_NODE)
+      return;
+    PairList stack;
+    stack.reserve(256);
+    stack.push_back({root, root});
+    while (stack.size()) {
+      auto [n0, n1] = stack.back();
+      stack.pop_back();
+      if (n0 == n1) {
+        if (!nodes[n0].is_leaf()) {
+          auto left = nodes[n0].left;
+          auto right = nodes[n0].right;
+          stack.push_back({left, right});
+          stack.push_back({right, right});
+          stack.push_back({left, left});
+        }
+        continue;
+      }
+      if (nodes[n0].is_leaf() && nodes[n1].is_leaf()) {
+        if (nodes[n0].aabb.overlaps(nodes[n1].aabb))
+          result.push_back({n0, n1});
+        continue;
+      }
+      if (!nodes[n0].fatten.overlaps(nodes[n1].fatten))
+        continue;
+      if (nodes[n1].is_leaf() ||
+          (!nodes[n0].is_leaf() &&
+           nodes[n0].fatten.area() >= nodes[n1].fatten.area())) {
+        stack.push_back({nodes[n0].right, n1});
+        stack.push_back({nodes[n0].left, n1});
+      } else {
+        stack.push_back({n0, nodes[n1].right});
+        stack.push_back({n0, nodes[n1].left});
+      }
+    }
+  }
+
+  Node &operator[](const unsigned int i) { return nodes[i]; }
+
+private:
+  unsigned int root;
+  float margin;
+  std::vector<Node> nodes;
+  unsigned int count;
+  unsigned int capacity;
+  unsigned int empty_node;
+
+  unsigned int alloc_node() {
+    if (empty_node == NULL_NODE) {
+      assert(count == capacity);
+      nodes.resize(capacity *= 2);
+      for (auto i = count; i < capacity; ++i) {
+        nodes[i].next = i + 1;
+      }
+      nodes[capacity - 1].next = NULL_NODE;
+      empty_node = count;
+    }
+    auto node = empty_node;
+    empty_node = nodes[node].next;
+    nodes[node].parent = NULL_NODE;
+    nodes[node].left = NULL_NODE;
+    nodes[node].right = NULL_NODE;
+    ++count;
+    return node;
+  }
+
+  void free_node(unsigned int node) {
+    nodes[node].next = empty_node;
+    empty_node = node;
+    --count;
+  }
+
+  void insert_node(unsigned int node, unsigned int &target) {
+    if (nodes[target].is_leaf()) {
+      auto branch = alloc_node();
+      if (auto grandparent = nodes[target].parent; grandparent != NULL_NODE) {
+        nodes[branch].parent = grandparent;
+        (nodes[grandparent].left == target ? nodes[grandparent].left
+                                           : nodes[grandparent].right) = branch;
+      }
+      nodes[branch].left = node;
+      nodes[branch].right = target;
+      nodes[node].parent = branch;
+      nodes[target].parent = branch;
+      target = branch;
+    } else {
+      auto left = nodes[target].left;
+      auto right = nodes[target].right;
+      auto area_diff0 = nodes[left].fatten.unite(nodes[node].fatten).area() -
+                        nodes[left].fatten.area();
+      auto area_diff1 = nodes[right].fatten.unite(nodes[node].fatten).area() -
+                        nodes[right].fatten.area();
+      if (area_diff0 < area_diff1) {
+        insert_node(node, left);
+      } else {
+        insert_node(node, right);
+      }
+    }
+    update_node(target);
+  }
+
+  void pull_node(unsigned int node) {
+    if (node == root) {
+      root = NULL_NODE;
+      return;
+    }
+    auto parent = nodes[node].parent;
+    auto sibling =
+        nodes[parent].left == node ? nodes[parent].right : nodes[parent].left;
+    auto grandparent = nodes[parent].parent;
+    if (grandparent != NULL_NODE) {
+      nodes[sibling].parent = grandparent;
+      (nodes[grandparent].left == parent ? nodes[grandparent].left
+                                         : nodes[grandparent].right) = sibling;
+    } else {
+      root = sibling;
+      nodes[sibling].parent = NULL_NODE;
+    }
+    free_node(parent);
+  }
+
+  void update_node(unsigned int node) {
+    if (nodes[node].is_leaf()) {
+      nodes[node].fatten.pos = nodes[node].aabb.pos - geom::Vector(margin);
+      nodes[node].fatten.dim = nodes[node].aabb.dim + geom::Vector(margin * 2);
+    } else {
+      auto left = nodes[node].left;
+      auto right = nodes[node].right;
+      nodes[node].aabb = nodes[left].aabb.unite(nodes[right].aabb);
+      nodes[node].fatten = nodes[left].fatten.unite(nodes[right].fatten);
+    }
+  }
+
+  void check_nodes(unsigned int node,
+                   std::vector<unsigned int> &invalid_nodes) {
+    if (nodes[node].is_leaf()) {
+      if (!nodes[node].is_valid())
+        invalid_nodes.push_back(node);
+    } else {
+      check_nodes(nodes[node].left, invalid_nodes);
+      check_nodes(nodes[node].right, invalid_nodes);
+    }
+  }
+};
+
+} // namespace aabb::legacy
+
+#endif // LEGACY_TREE_H
@@ -0,0 +1,160 @@
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Level.hpp"
+#include "World.hpp"
+
+namespace {
+
+constexpr auto CHUNK_TILES = (std::size_t)CHUNK_SIZE * CHUNK_SIZE;
+
+std::size_t padded(std::size_t size) { return (size + 7) & ~(std::size_t)7; }
+
+template <typename T>
+void write_padded(std::ostream &out, const std::vector<T> &items) {
+  static const char zeros[8] = {};
+  auto size = items.size() * sizeof(T);
+  out.write(reinterpret_cast<const char *>(items.data()), size);
+  out.write(zeros, padded(size) - size);
+}
+
+std::size_t chunk_count(std::uint32_t width, std::uint32_t height) {
+  return (std::size_t)((width + CHUNK_SIZE - 1) / CHUNK_SIZE) *
+         ((height + CHUNK_SIZE - 1) / CHUNK_SIZE);
+}
+
+} // namespace
+
+LevelFile::LevelFile(const std::string &path) {
+#ifdef _WIN32
+  std::ifstream in{path, std::ios::binary};
+  if (!in)
+    throw std::runtime_error(path + ": can't open level");
+  buffer.assign(std::istreambuf_iterator<char>{in}, {});
+  data = buffer.data();
+  size = buffer.size();
+#else
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error(path + ": can't open level");
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    throw std::runtime_error(path + ": can't read level");
+  }
+  size = (std::size_t)info.st_size;
+  auto *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    throw std::runtime_error(path + ": can't map level");
+  data = static_cast<const std::uint8_t *>(mapping);
+#endif
+  try {
+    parse();
+  } catch (const std::runtime_error &error) {
+#ifndef _WIN32
+    munmap(const_cast<std::uint8_t *>(data), size);
+#endif
+    throw std::runtime_error(path + ": " + error.what());
+  }
+}
+
+LevelFile::~LevelFile() {
+#ifndef _WIN32
+  munmap(const_cast<std::uint8_t *>(data), size);
+#endif
+}
+
+// Only checks what is needed to stay inside the mapping, the contents are
+// trusted
+void LevelFile::parse() {
+  if (size < sizeof(LevelHeader))
+    throw std::runtime_error("truncated level");
+  header = reinterpret_cast<const LevelHeader *>(data);
+  if (header->magic != LEVEL_MAGIC)
+    throw std::runtime_error("not a cooked level");
+  if (header->version != LEVEL_VERSION)
+    throw std::runtime_error("level of another version, cook it again");
+
+  auto chunks = chunk_count(header->width, header->height);
+  auto offset = sizeof(LevelHeader);
+  for (auto i = 0u; i < header->layers; ++i) {
+    if (size - offset < sizeof(LayerHeader))
+      throw std::runtime_error("truncated level");
+    auto &layer = *reinterpret_cast<const LayerHeader *>(data + offset);
+    offset += sizeof(LayerHeader);
+    auto tiles = chunks * CHUNK_TILES;
+    auto bodies = padded(layer.bodies * sizeof(CookedBody));
+    auto begins = padded((chunks + 1) * sizeof(std::uint32_t));
+    auto index = padded(layer.bodies * sizeof(std::uint32_t));
+    if (size - offset < tiles + bodies + begins + index)
+      throw std::runtime_error("truncated level");
+    auto *base = data + offset;
+    contents.push_back(
+        {reinterpret_cast<const Tile *>(base),
+         reinterpret_cast<const CookedBody *>(base + tiles), layer.bodies,
+         reinterpret_cast<const std::uint32_t *>(base + tiles + bodies),
+         reinterpret_cast<const std::uint32_t *>(base + tiles + bodies +
+                                                 begins)});
+    if (contents.back().chunk_begin[chunks] != layer.bodies)
+      throw std::runtime_error("broken body index");
+    offset += tiles + bodies + begins + index;
+  }
+}
+
+bool cook_level(const std::vector<Layer> &layers, std::ostream &out) {
+  auto width = layers.empty() ? 0 : layers.front().width;
+  auto height = layers.empty() ? 0 : layers.front().height;
+  if (width > 0xFFFF || height > 0xFFFF)
+    return false;
+  LevelHeader header{LEVEL_MAGIC, LEVEL_VERSION, (std::uint32_t)width,
+                     (std::uint32_t)height, (std::uint32_t)layers.size(), 0};
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  Jobs jobs{std::thread::hardware_concurrency()};
+  for (auto &layer : layers) {
+    if (layer.width != width || layer.height != height)
+      return false;
+    auto scanned = scan_layer(layer, jobs);
+    auto &tiles = scanned.tiles;
+    auto &bodies = scanned.bodies;
+
+    LayerHeader info{(std::uint32_t)bodies.size(), 0};
+    out.write(reinterpret_cast<const char *>(&info), sizeof(info));
+    for (auto cy = 0; cy < tiles.chunk_rows(); ++cy) {
+      for (auto cx = 0; cx < tiles.chunk_columns(); ++cx)
+        out.write(reinterpret_cast<const char *>(tiles.chunk_tiles(cx, cy)),
+                  CHUNK_TILES);
+    }
+    write_padded(out, bodies);
+
+    // Counting sort of the body numbers by chunk keeps the scan order
+    // within every chunk
+    std::vector<std::uint32_t> begin(chunk_count(width, height) + 1, 0);
+    auto chunk_of = [&](const CookedBody &current) {
+      return (current.y / CHUNK_SIZE) * tiles.chunk_columns() +
+             current.x / CHUNK_SIZE;
+    };
+    for (auto &current : bodies)
+      ++begin[chunk_of(current) + 1];
+    for (auto i = 1u; i < begin.size(); ++i)
+      begin[i] += begin[i - 1];
+    std::vector<std::uint32_t> index(bodies.size());
+    auto next = begin;
+    for (auto i = 0u; i < bodies.size(); ++i)
+      index[next[chunk_of(bodies[i])]++] = i;
+    write_padded(out, begin);
+    write_padded(out, index);
+  }
+  return (bool)out;
+}
@@ -0,0 +1,102 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "Tilemap.hpp"
+
+// Levels cooked ahead of time from the layer images by chonker-run-cook, so
+// that loading skips image decoding and the pixel scan. Layout, in native
+// byte order:
+//
+//   LevelHeader
+//   per layer: LayerHeader, the tiles of every chunk in Tilemap order
+//              (CHUNK_SIZE * CHUNK_SIZE each), its CookedBody records, then
+//              the body index: chunks + 1 offsets into a list of body
+//              numbers grouped by chunk, and that list
+//
+// Every array is padded to a multiple of 8 bytes. Crates move, so their
+// tiles are left empty in the chunks. Walls and crates are listed as bodies
+// in the order of the pixel scan, the index lets a chunk be read alone.
+constexpr std::uint32_t LEVEL_MAGIC = 0x564C4843; // "CHLV"
+constexpr std::uint32_t LEVEL_VERSION = 2;
+
+struct LevelHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint32_t width, height; // in tiles
+  std::uint32_t layers;
+  std::uint32_t unused;
+};
+
+struct LayerHeader {
+  std::uint32_t bodies;
+  std::uint32_t unused;
+};
+
+// Wall or crate at a tile
+struct CookedBody {
+  std::uint16_t x, y;
+  Tile tile;
+  std::uint8_t unused;
+};
+
+// Layer inside a loaded level file, pointers into its mapping
+struct CookedLayer {
+  const Tile *chunks;
+  const CookedBody *bodies;
+  std::size_t body_count;
+  const std::uint32_t *chunk_begin;  // chunks + 1 offsets into chunk_bodies
+  const std::uint32_t *chunk_bodies; // body numbers grouped by chunk
+
+  // Tiles of chunk number i, row by row
+  const Tile *chunk_tiles(std::size_t i) const {
+    return chunks + i * CHUNK_SIZE * CHUNK_SIZE;
+  }
+  // Visits the bodies of chunk number i in scan order
+  template <typename Visitor>
+  void each_body(std::size_t i, Visitor &&visitor) const {
+    for (auto j = chunk_begin[i]; j < chunk_begin[i + 1]; ++j)
+      visitor(bodies[chunk_bodies[j]]);
+  }
+};
+
+// Read-only memory mapping of a cooked level. Throws std::runtime_error if
+// the file can't be read or isn't a level of this version.
+class LevelFile {
+public:
+  explicit LevelFile(const std::string &path);
+  ~LevelFile();
+  LevelFile(const LevelFile &) = delete;
+  LevelFile &operator=(const LevelFile &) = delete;
+
+  int width() const { return header->width; };
+  int height() const { return header->height; };
+  // Size in chunks, chunks are numbered row by row
+  int chunk_columns() const { return (width() + CHUNK_SIZE - 1) / CHUNK_SIZE; };
+  int chunk_rows() const { return (height() + CHUNK_SIZE - 1) / CHUNK_SIZE; };
+  const std::vector<CookedLayer> &layers() const { return contents; };
+
+private:
+  const std::uint8_t *data = nullptr;
+  std::size_t size = 0;
+#ifdef _WIN32
+  std::vector<std::uint8_t> buffer; // read whole, no mapping
+#endif
+  const LevelHeader *header;
+  std::vector<CookedLayer> contents;
+
+  void parse();
+};
+
+struct Layer;
+
+// Writes layers decoded by read_layer in the cooked format, all of the same
+// size. Returns false if the stream fails.
+bool cook_level(const std::vector<Layer> &layers, std::ostream &out);
+
+#endif // LEVEL_H
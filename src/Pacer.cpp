@@ -0,0 +1,47 @@
+#include <algorithm>
+#include <thread>
+
+#include "Pacer.hpp"
+
+using namespace std::chrono;
+
+Pacer::Pacer(int ticks_per_sec, int frames_per_sec, int max_ticks)
+    : tick{duration_cast<Clock::duration>(seconds{1}) / ticks_per_sec},
+      frame{frames_per_sec > 0
+                ? duration_cast<Clock::duration>(seconds{1}) / frames_per_sec
+                : tick},
+      max_ticks{max_ticks}, next_tick{Clock::now() + tick},
+      next_frame{Clock::now()} {}
+
+int Pacer::ticks() {
+  auto now = Clock::now();
+  if (now < next_tick)
+    return 0;
+  auto due = (now - next_tick) / tick + 1;
+  next_tick += due * tick;
+  if (due > max_ticks) {
+    dropped_ticks += due - max_ticks;
+    return max_ticks;
+  }
+  return (int)due;
+}
+
+float Pacer::alpha() const {
+  auto since = Clock::now() - (next_tick - tick);
+  return std::clamp(duration<float>(since) / duration<float>(tick), 0.0f,
+                    1.0f);
+}
+
+void Pacer::wait() {
+  next_frame += frame;
+  auto now = Clock::now();
+  // A late frame moves the schedule instead of rushing the next ones
+  if (next_frame <= now) {
+    next_frame = now;
+    return;
+  }
+  if (next_frame - now > slack)
+    std::this_thread::sleep_until(next_frame - slack);
+  while (Clock::now() < next_frame)
+    std::this_thread::yield();
+}
@@ -0,0 +1,35 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <chrono>
+#include <cstdint>
+
+// Paces the main loop: fixed ticks are counted off the clock and frames are
+// waited for instead of spun. Sleeps overshoot by up to a scheduler quantum,
+// so waits sleep until slack before the deadline and spin the rest.
+class Pacer {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  // frames_per_sec of 0 draws a frame per tick
+  Pacer(int ticks_per_sec, int frames_per_sec, int max_ticks);
+
+  // Ticks due since the last call, at most max_ticks. Time for the ones over
+  // is dropped, so a stall doesn't have to be caught up with.
+  int ticks();
+  // Fraction of a tick since the last one that ran
+  float alpha() const;
+  // Waits until the next frame is due
+  void wait();
+
+  std::uint64_t dropped() const { return dropped_ticks; };
+  Clock::duration slack = std::chrono::milliseconds{2};
+
+private:
+  Clock::duration tick, frame;
+  int max_ticks;
+  Clock::time_point next_tick, next_frame;
+  std::uint64_t dropped_ticks = 0;
+};
+
+#endif // PACER_H
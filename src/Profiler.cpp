@@ -0,0 +1,83 @@
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Profiler.hpp"
+
+namespace profile {
+
+namespace {
+
+struct Ring {
+  unsigned int thread;
+  std::vector<Sample> samples = std::vector<Sample>(RING_SIZE);
+  std::atomic<std::uint64_t> head{0}; // samples ever written
+};
+
+// Rings outlive their threads, so that samples of stopped workers still
+// get exported
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<Ring>> rings;
+const auto epoch = Clock::now();
+
+Ring &local_ring() {
+  thread_local Ring *ring = [] {
+    std::lock_guard lock{rings_mutex};
+    auto &created = rings.emplace_back(std::make_unique<Ring>());
+    created->thread = (unsigned int)rings.size() - 1;
+    return created.get();
+  }();
+  return *ring;
+}
+
+double microseconds(Clock::time_point time) {
+  return std::chrono::duration<double, std::micro>(time - epoch).count();
+}
+
+// Names are literals in our own code, only quotes and backslashes would
+// need escaping
+void write_name(std::ofstream &out, const char *name) {
+  for (; *name; ++name) {
+    if (*name == '"' || *name == '\\')
+      out << '\\';
+    out << *name;
+  }
+}
+
+} // namespace
+
+void record(const char *name, Clock::time_point begin, Clock::time_point end) {
+  auto &ring = local_ring();
+  auto head = ring.head.load(std::memory_order_relaxed);
+  ring.samples[head % RING_SIZE] = {name, begin, end};
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+bool write_trace(const std::string &path) {
+  std::ofstream out{path};
+  if (!out)
+    return false;
+  out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+  auto first = true;
+  std::lock_guard lock{rings_mutex};
+  for (auto &ring : rings) {
+    auto head = ring->head.load(std::memory_order_acquire);
+    auto oldest = head > RING_SIZE ? head - RING_SIZE : 0;
+    for (auto i = oldest; i < head; ++i) {
+      auto &sample = ring->samples[i % RING_SIZE];
+      auto start = microseconds(sample.begin);
+      out << (first ? "\n" : ",\n") << "{\"name\":\"";
+      write_name(out, sample.name);
+      out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->thread
+          << ",\"ts\":" << start
+          << ",\"dur\":" << microseconds(sample.end) - start << "}";
+      first = false;
+    }
+  }
+  out << "\n]}\n";
+  return (bool)out;
+}
+
+} // namespace profile
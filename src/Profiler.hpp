@@ -0,0 +1,63 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Scoped timers recorded into a ring buffer per thread, exported as Chrome
+// trace JSON (chrome://tracing, ui.perfetto.dev). Only built with
+// CHONKER_PROFILE defined, otherwise PROFILE_SCOPE expands to nothing.
+//
+// Recording takes no lock: every thread only writes its own ring. Export
+// reads all rings, so it belongs between frames when the job pool is idle.
+namespace profile {
+
+#ifdef CHONKER_PROFILE
+constexpr auto enabled = true;
+#else
+constexpr auto enabled = false;
+#endif
+
+// Samples kept per thread, older ones are overwritten
+constexpr std::size_t RING_SIZE = 1 << 18;
+
+using Clock = std::chrono::steady_clock;
+
+struct Sample {
+  const char *name; // string literal, never copied
+  Clock::time_point begin, end;
+};
+
+void record(const char *name, Clock::time_point begin, Clock::time_point end);
+
+// Writes the samples of all threads, returns false if the file can't be
+// written
+bool write_trace(const std::string &path);
+
+class Scope {
+public:
+  explicit Scope(const char *name) : name{name}, begin{Clock::now()} {}
+  ~Scope() { record(name, begin, Clock::now()); }
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+private:
+  const char *name;
+  Clock::time_point begin;
+};
+
+} // namespace profile
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef CHONKER_PROFILE
+#define PROFILE_SCOPE(name)                                                    \
+  profile::Scope PROFILE_CONCAT(profile_scope_, __LINE__) { name }
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+#endif // PROFILER_H
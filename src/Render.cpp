@@ -8,8 +8,9 @@
 
 #endif
 
-Render::Render(int width, int height, const std::string &title,
-               const std::string &path) {
+#include "Profiler.hpp"
+
+Render::Render(int width, int height, const std::string &title) {
   if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
     throw std::runtime_error(SDL_GetError());
   }
@@ -28,15 +29,23 @@ Render::Render(int width, int height, const std::string &title,
     throw std::runtime_error(SDL_GetError());
   }
   SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-  if (SDL_Surface *image = IMG_Load(path.c_str())) {
-    if ((texture = SDL_CreateTextureFromSurface(renderer, image)) == nullptr) {
-      throw std::runtime_error(SDL_GetError());
-    }
-  }
   viewport = SDL_FRect{.0f, .0f, (float)width, (float)height};
 }
 
+void Render::load_sheet(SDL_Surface *image) {
+  if (!image)
+    return;
+  if (texture)
+    SDL_DestroyTexture(texture);
+  if ((texture = SDL_CreateTextureFromSurface(renderer, image)) == nullptr) {
+    throw std::runtime_error(SDL_GetError());
+  }
+  sheet_width = image->w;
+  sheet_height = image->h;
+}
+
 Render::~Render() {
+  reset_chunks();
   if (renderer)
     SDL_DestroyRenderer(renderer);
   if (window)
@@ -46,6 +55,10 @@ Render::~Render() {
 }
 
 void Render::present() {
+  PROFILE_SCOPE("Render::present");
+  flush();
+  last_stats = frame_stats;
+  frame_stats = {};
   SDL_RenderPresent(renderer);
   SDL_RenderClear(renderer);
 }
@@ -54,22 +67,74 @@ void Render::set_title(const std::string &text) {
   SDL_SetWindowTitle(window, text.c_str());
 }
 
+int Render::refresh_rate() const {
+  SDL_DisplayMode mode;
+  if (SDL_GetWindowDisplayMode(window, &mode) != 0)
+    return 0;
+  return mode.refresh_rate;
+}
+
 void Render::update(const SDL_FRect &pos, const SDL_Rect &tile,
                     SDL_Texture *texture) {
+  int width = texture_width, height = texture_height;
+  if (texture != batch_texture)
+    SDL_QueryTexture(texture, nullptr, nullptr, &width, &height);
+  quad(pos, tile, texture, width, height);
+}
+
+// Queues a quad cut from a texture of the given size, the batch is drawn
+// first when the texture changes
+void Render::quad(const SDL_FRect &pos, const SDL_Rect &tile,
+                  SDL_Texture *texture, int width, int height) {
   // if (SDL_HasIntersection(&viewport, &pos)) {
   if (!(pos.x >= viewport.x + viewport.w || pos.y >= viewport.y + viewport.h ||
         pos.x + pos.w <= viewport.x || pos.y + pos.h <= viewport.y)) {
-    SDL_FRect result{pos.x - viewport.x, pos.y - viewport.y, pos.w, pos.h};
-    SDL_RenderCopyF(renderer, texture, &tile, &result);
+    if (texture != batch_texture) {
+      flush();
+      batch_texture = texture;
+      texture_width = width;
+      texture_height = height;
+    }
+
+    auto x = pos.x - viewport.x;
+    auto y = pos.y - viewport.y;
+    auto u0 = tile.x / texture_width;
+    auto v0 = tile.y / texture_height;
+    auto u1 = (tile.x + tile.w) / texture_width;
+    auto v1 = (tile.y + tile.h) / texture_height;
+    SDL_Color white{255, 255, 255, 255};
+    vertices.push_back({{x, y}, white, {u0, v0}});
+    vertices.push_back({{x + pos.w, y}, white, {u1, v0}});
+    vertices.push_back({{x + pos.w, y + pos.h}, white, {u1, v1}});
+    vertices.push_back({{x, y + pos.h}, white, {u0, v1}});
     updated = true;
   }
 }
 
+// Draws the pending quads. Indices only depend on the quad count, so they
+// are written once for the biggest batch seen.
+void Render::flush() {
+  if (vertices.empty())
+    return;
+  auto quads = (int)vertices.size() / 4;
+  for (auto i = (int)indices.size() / 6; i < quads; ++i) {
+    for (auto corner : {0, 1, 2, 0, 2, 3})
+      indices.push_back(i * 4 + corner);
+  }
+  SDL_RenderGeometry(renderer, batch_texture, vertices.data(),
+                     (int)vertices.size(), indices.data(), quads * 6);
+  ++frame_stats.draw_calls;
+  frame_stats.quads += quads;
+  vertices.clear();
+  batch_texture = nullptr;
+}
+
 void Render::update(const SDL_FRect &pos, const SDL_Rect &tile) {
-  update(pos, tile, texture);
+  quad(pos, tile, texture, sheet_width, sheet_height);
 }
 
 void Render::draw_frame(int x1, int y1, int x2, int y2, unsigned int color) {
+  flush();
   SDL_Rect pos{x1, y1, x2 - x1, y2 - y1};
   // if (SDL_HasIntersection(&viewport, &pos)) {
   if (!(pos.x >= viewport.x + viewport.w || pos.y >= viewport.y + viewport.h ||
@@ -86,4 +151,60 @@ void Render::draw_frame(int x1, int y1, int x2, int y2, unsigned int color) {
                        x2 - viewport.x, y2 - viewport.y);
     updated = true;
   }
+}
+
+void Render::update_chunk(std::uint64_t key, const SDL_FRect &pos,
+                          const std::function<void()> &paint) {
+  if (auto found = chunk_index.find(key); found != chunk_index.end()) {
+    chunks.splice(chunks.begin(), chunks, found->second);
+  } else {
+    auto width = (int)pos.w;
+    auto height = (int)pos.h;
+    auto *target =
+        SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                          SDL_TEXTUREACCESS_TARGET, width, height);
+    if (target == nullptr) {
+      throw std::runtime_error(SDL_GetError());
+    }
+    SDL_SetTextureBlendMode(target, SDL_BLENDMODE_BLEND);
+
+    // Paint on a transparent texture with the chunk as viewport
+    Uint8 r, g, b, a;
+    SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+    flush();
+    SDL_SetRenderTarget(renderer, target);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_TRANSPARENT);
+    SDL_RenderClear(renderer);
+    auto screen = viewport;
+    viewport = pos;
+    paint();
+    flush();
+    viewport = screen;
+    SDL_SetRenderTarget(renderer, nullptr);
+    SDL_SetRenderDrawColor(renderer, r, g, b, a);
+
+    auto size = (std::size_t)width * height * 4;
+    chunks.push_front({key, target, width, height, size});
+    chunk_index[key] = chunks.begin();
+    chunk_bytes += size;
+    while (chunk_bytes > chunk_budget && chunks.size() > 1) {
+      auto &last = chunks.back();
+      SDL_DestroyTexture(last.texture);
+      chunk_bytes -= last.size;
+      chunk_index.erase(last.key);
+      chunks.pop_back();
+    }
+  }
+  auto &chunk = chunks.front();
+  quad(pos, SDL_Rect{0, 0, chunk.width, chunk.height}, chunk.texture,
+       chunk.width, chunk.height);
+}
+
+void Render::reset_chunks() {
+  flush();
+  for (auto &chunk : chunks)
+    SDL_DestroyTexture(chunk.texture);
+  chunks.clear();
+  chunk_index.clear();
+  chunk_bytes = 0;
 }
\ No newline at end of file
@@ -1,4 +1,9 @@
+#include <cstdint>
+#include <functional>
+#include <list>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <SDL.h>
 #include <SDL_image.h>
@@ -6,24 +11,72 @@
 
 #include <entt/entt.hpp>
 
+// Submissions of one frame
+struct RenderStats {
+  int draw_calls = 0;
+  int quads = 0;
+};
+
 class Render {
 public:
   bool updated = false;
 
-  Render(int width, int height, const std::string &title,
-         const std::string &path);
+  Render(int width, int height, const std::string &title);
   ~Render();
 
+  // Makes the texture tiles are drawn from out of a decoded sprite sheet,
+  // nothing is drawn without one
+  void load_sheet(SDL_Surface *image);
+
   void present();
   void set_title(const std::string &);
+  // Refresh rate of the window's display in Hz, 0 if unknown
+  int refresh_rate() const;
+  // Textures other than the sheet and the cached chunks have their size
+  // queried whenever the batch switches to them
   void update(const SDL_FRect &pos, const SDL_Rect &tile, SDL_Texture *texture);
   void update(const SDL_FRect &pos, const SDL_Rect &tile);
   void draw_frame(int x1, int y1, int x2, int y2, unsigned int color);
+  // Draws the cached texture of a static chunk placed at pos in world
+  // coordinates. On a miss the texture is created and paint draws into it
+  // with update() as if it were the screen.
+  void update_chunk(std::uint64_t key, const SDL_FRect &pos,
+                    const std::function<void()> &paint);
+  // Drops all cached chunks, needed when render targets lose their content
+  void reset_chunks();
+  // Counts of the last presented frame
+  const RenderStats &stats() const { return last_stats; };
 
   SDL_FRect viewport;
+  std::size_t chunk_budget = 64 << 20; // bytes of cached chunk textures
 
 private:
-  SDL_Window *window;     // TODO: wrap with unique_ptr
-  SDL_Renderer *renderer; // TODO: wrap with unique_ptr
-  SDL_Texture *texture;   // TODO: wrap with unique_ptr
+  struct Chunk {
+    std::uint64_t key;
+    SDL_Texture *texture;
+    int width, height;
+    std::size_t size;
+  };
+
+  SDL_Window *window;             // TODO: wrap with unique_ptr
+  SDL_Renderer *renderer;         // TODO: wrap with unique_ptr
+  SDL_Texture *texture = nullptr; // TODO: wrap with unique_ptr
+  int sheet_width = 1, sheet_height = 1;
+
+  // Least recently drawn chunks are at the back and get evicted first
+  std::list<Chunk> chunks;
+  std::unordered_map<std::uint64_t, std::list<Chunk>::iterator> chunk_index;
+  std::size_t chunk_bytes = 0;
+
+  // Quads waiting to be drawn with one call, all from batch_texture. The
+  // buffers keep their capacity between frames.
+  SDL_Texture *batch_texture = nullptr;
+  float texture_width = 1, texture_height = 1;
+  std::vector<SDL_Vertex> vertices;
+  std::vector<int> indices;
+  RenderStats frame_stats, last_stats;
+
+  void quad(const SDL_FRect &pos, const SDL_Rect &tile, SDL_Texture *texture,
+            int width, int height);
+  void flush();
 };
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+#include "Scene.hpp"
+
+std::vector<Layer> generate_scene(const SceneConfig &config) {
+  auto bodies = std::max(config.crates + config.bricks, 1);
+  auto density = std::clamp(config.density, 0.01f, 1.0f);
+  // Interior side that fits all bodies at the requested density, plus walls
+  auto side = (int)std::ceil(std::sqrt(bodies / density)) + 2;
+
+  std::mt19937 engine{config.seed};
+
+  Layer decoration{side, side, std::vector<Uint32>(side * side)};
+  for (auto &pixel : decoration.pixels) {
+    switch (engine() % 8) {
+    case 0:
+      pixel = SAND_PIXEL;
+      break;
+    case 1:
+      pixel = WATER_PIXEL;
+      break;
+    default:
+      pixel = GRASS_PIXEL;
+      break;
+    }
+  }
+
+  Layer solid{side, side, std::vector<Uint32>(side * side, 0)};
+  std::vector<int> cells;
+  cells.reserve((side - 2) * (side - 2));
+  for (auto y = 0; y < side; ++y) {
+    for (auto x = 0; x < side; ++x) {
+      if (x == 0 || y == 0 || x == side - 1 || y == side - 1) {
+        solid.pixels[y * side + x] = STONE_PIXEL;
+      } else {
+        cells.push_back(y * side + x);
+      }
+    }
+  }
+
+  // Partial Fisher-Yates: the first crates + bricks cells are random picks
+  auto count = std::min<std::size_t>(bodies, cells.size());
+  for (std::size_t i = 0; i < count; ++i) {
+    std::uniform_int_distribution<std::size_t> pick{i, cells.size() - 1};
+    std::swap(cells[i], cells[pick(engine)]);
+    solid.pixels[cells[i]] =
+        (int)i < config.crates ? CRATE_PIXEL : BRICK_PIXEL;
+  }
+
+  return {decoration, solid};
+}
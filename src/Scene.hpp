@@ -0,0 +1,20 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+
+#include "World.hpp"
+
+// Parameters of a procedurally generated level
+struct SceneConfig {
+  int crates = 1000;
+  int bricks = 1000;
+  float density = 0.25f; // Share of the level cells occupied by bodies
+  unsigned int seed = 1;
+};
+
+// Builds a walled level with randomly scattered crates and bricks on top of
+// a decoration layer. Same config always gives the same level.
+std::vector<Layer> generate_scene(const SceneConfig &config);
+
+#endif // SCENE_H
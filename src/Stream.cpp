@@ -0,0 +1,61 @@
+#include "Stream.hpp"
+#include "Profiler.hpp"
+
+Streamer::Streamer(const LevelFile &level)
+    : level{level}, loader{&Streamer::run, this} {}
+
+Streamer::~Streamer() {
+  {
+    std::lock_guard lock{mutex};
+    stopping = true;
+  }
+  wake.notify_one();
+  loader.join();
+}
+
+void Streamer::request(int cx, int cy) {
+  {
+    std::lock_guard lock{mutex};
+    requests.push_back({cx, cy});
+  }
+  wake.notify_one();
+}
+
+bool Streamer::poll(Chunk &chunk) {
+  std::lock_guard lock{mutex};
+  if (finished.empty())
+    return false;
+  chunk = std::move(finished.front());
+  finished.pop_front();
+  return true;
+}
+
+Streamer::Chunk Streamer::read(int cx, int cy) const {
+  PROFILE_SCOPE("Streamer::read");
+  Chunk chunk{cx, cy, {}, {}};
+  auto index = (std::size_t)cy * level.chunk_columns() + cx;
+  for (auto &layer : level.layers()) {
+    auto *tiles = layer.chunk_tiles(index);
+    auto &copy = chunk.tiles.emplace_back();
+    std::copy(tiles, tiles + copy.size(), copy.begin());
+    auto &bodies = chunk.bodies.emplace_back();
+    layer.each_body(index,
+                    [&](const CookedBody &body) { bodies.push_back(body); });
+  }
+  return chunk;
+}
+
+void Streamer::run() {
+  std::unique_lock lock{mutex};
+  for (;;) {
+    wake.wait(lock, [&] { return stopping || !requests.empty(); });
+    if (stopping)
+      return;
+    auto [cx, cy] = requests.front();
+    requests.pop_front();
+    lock.unlock();
+    auto chunk = read(cx, cy);
+    lock.lock();
+    finished.push_back(std::move(chunk));
+  }
+}
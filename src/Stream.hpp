@@ -0,0 +1,49 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Level.hpp"
+
+// Reads chunks of a cooked level on a background thread, so page faults on
+// the mapping and copying never stall a tick. Requests and finished chunks
+// pass through queues under one mutex, the main thread only polls.
+class Streamer {
+public:
+  // All layers of one chunk, copied out of the level file
+  struct Chunk {
+    int cx, cy;
+    std::vector<std::array<Tile, CHUNK_SIZE * CHUNK_SIZE>> tiles;
+    std::vector<std::vector<CookedBody>> bodies;
+  };
+
+  // The level must outlive the streamer
+  explicit Streamer(const LevelFile &level);
+  ~Streamer();
+  Streamer(const Streamer &) = delete;
+  Streamer &operator=(const Streamer &) = delete;
+
+  void request(int cx, int cy);
+  // Takes the next finished chunk, false if there is none yet
+  bool poll(Chunk &chunk);
+  // Reads a chunk on the calling thread
+  Chunk read(int cx, int cy) const;
+
+private:
+  const LevelFile &level;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<std::pair<int, int>> requests;
+  std::deque<Chunk> finished;
+  bool stopping = false;
+  std::thread loader;
+
+  void run();
+};
+
+#endif // STREAM_H
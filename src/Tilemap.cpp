@@ -0,0 +1,92 @@
+#include <cassert>
+
+#include "Tilemap.hpp"
+
+SDL_Rect tile_sprite(Tile tile) {
+  switch (tile) {
+  case Tile::STONE:
+    return {16, 0, 16, 16};
+  case Tile::GRASS:
+    return {32, 0, 16, 16};
+  case Tile::WATER:
+    return {0, 32, 16, 16};
+  case Tile::SAND:
+    return {48, 0, 16, 16};
+  case Tile::BRICK:
+    return {64, 0, 16, 16};
+  case Tile::CRATE:
+    return {80, 0, 16, 16};
+  case Tile::LAVA:
+    return {0, 48, 16, 16};
+  default:
+    return {0, 0, 0, 0};
+  }
+}
+
+namespace {
+
+const std::array<Tile, CHUNK_SIZE * CHUNK_SIZE> EMPTY_TILES{};
+
+} // namespace
+
+Tilemap::Tilemap(int width, int height)
+    : columns{width}, rows{height},
+      stride{(width + CHUNK_SIZE - 1) / CHUNK_SIZE} {
+  chunks.resize(stride * ((height + CHUNK_SIZE - 1) / CHUNK_SIZE));
+}
+
+Tile Tilemap::get(int x, int y) const {
+  auto *current = chunk(x, y);
+  if (!current)
+    return Tile::EMPTY;
+  return current->tiles[(y % CHUNK_SIZE) * CHUNK_SIZE + x % CHUNK_SIZE];
+}
+
+void Tilemap::set(int x, int y, Tile tile) {
+  auto &current = chunk(x, y);
+  if (!current) {
+    if (tile == Tile::EMPTY)
+      return;
+    current = std::make_unique<Chunk>(Chunk{EMPTY_TILES, 0});
+  }
+  auto &cell = current->tiles[(y % CHUNK_SIZE) * CHUNK_SIZE + x % CHUNK_SIZE];
+  current->count += (tile != Tile::EMPTY) - (cell != Tile::EMPTY);
+  cell = tile;
+}
+
+const Tile *Tilemap::chunk_tiles(int cx, int cy) const {
+  assert(cx >= 0 && cx < stride && cy >= 0 && cy < chunk_rows());
+  auto &current = chunks[cy * stride + cx];
+  return current ? current->tiles.data() : EMPTY_TILES.data();
+}
+
+void Tilemap::set_chunk(int cx, int cy, const Tile *tiles) {
+  assert(cx >= 0 && cx < stride && cy >= 0 && cy < chunk_rows());
+  auto count =
+      (int)std::count_if(tiles, tiles + EMPTY_TILES.size(),
+                         [](Tile tile) { return tile != Tile::EMPTY; });
+  auto &current = chunks[cy * stride + cx];
+  if (!count) {
+    current.reset();
+    return;
+  }
+  if (!current)
+    current = std::make_unique<Chunk>();
+  std::copy(tiles, tiles + EMPTY_TILES.size(), current->tiles.begin());
+  current->count = count;
+}
+
+void Tilemap::clear_chunk(int cx, int cy) {
+  assert(cx >= 0 && cx < stride && cy >= 0 && cy < chunk_rows());
+  chunks[cy * stride + cx].reset();
+}
+
+std::unique_ptr<Tilemap::Chunk> &Tilemap::chunk(int x, int y) {
+  assert(x >= 0 && x < columns && y >= 0 && y < rows);
+  return chunks[(y / CHUNK_SIZE) * stride + x / CHUNK_SIZE];
+}
+
+const Tilemap::Chunk *Tilemap::chunk(int x, int y) const {
+  assert(x >= 0 && x < columns && y >= 0 && y < rows);
+  return chunks[(y / CHUNK_SIZE) * stride + x / CHUNK_SIZE].get();
+}
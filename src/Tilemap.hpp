@@ -0,0 +1,103 @@
+#ifndef TILEMAP_H
+#define TILEMAP_H
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <vector>
+
+#include <SDL.h>
+
+// Kind of a map cell, stored as one byte
+enum class Tile : Uint8 {
+  EMPTY,
+  STONE,
+  GRASS,
+  WATER,
+  SAND,
+  BRICK,
+  CRATE,
+  LAVA
+};
+
+// Source rectangle of a tile in the sprite sheet
+SDL_Rect tile_sprite(Tile tile);
+
+// Tiles per chunk side
+constexpr auto CHUNK_SIZE = 16;
+
+// Tile layer split into square chunks, so that drawing only touches the
+// chunks under the viewport and skips the empty ones. Only chunks that got
+// tiles are allocated, a streamed level keeps the ones near the camera.
+// Coordinates are in tiles.
+class Tilemap {
+public:
+  Tilemap(int width, int height);
+
+  Tile get(int x, int y) const;
+  void set(int x, int y, Tile tile);
+  int width() const { return columns; };
+  int height() const { return rows; };
+
+  // Chunks are stored row by row, each holds CHUNK_SIZE rows of tiles.
+  // Tiles of chunks past the edges of the map are empty. A map 0 tiles
+  // wide, as from an image that couldn't be read, has no chunks.
+  int chunk_columns() const { return stride; };
+  int chunk_rows() const { return stride ? (int)chunks.size() / stride : 0; };
+  const Tile *chunk_tiles(int cx, int cy) const;
+  void set_chunk(int cx, int cy, const Tile *tiles);
+  // Empties a chunk and frees its tiles
+  void clear_chunk(int cx, int cy);
+
+  // Visits every chunk with tiles that has a tile with x0 <= x < x1 and
+  // y0 <= y < y1 as visitor(cx, cy), in chunk coordinates
+  template <typename Visitor>
+  void each_chunk(int x0, int y0, int x1, int y1, Visitor &&visitor) const {
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    x1 = std::min(x1, columns);
+    y1 = std::min(y1, rows);
+    for (auto cy = y0 / CHUNK_SIZE; cy * CHUNK_SIZE < y1; ++cy) {
+      for (auto cx = x0 / CHUNK_SIZE; cx * CHUNK_SIZE < x1; ++cx) {
+        if (auto &current = chunks[cy * stride + cx]; current && current->count)
+          visitor(cx, cy);
+      }
+    }
+  }
+
+  // Visits every non-empty tile with x0 <= x < x1 and y0 <= y < y1 as
+  // visitor(x, y, tile), chunk by chunk
+  template <typename Visitor>
+  void each(int x0, int y0, int x1, int y1, Visitor &&visitor) const {
+    each_chunk(x0, y0, x1, y1, [&](int cx, int cy) {
+      auto &current = *chunks[cy * stride + cx];
+      auto left = std::max(x0, cx * CHUNK_SIZE);
+      auto right = std::min({x1, columns, (cx + 1) * CHUNK_SIZE});
+      auto top = std::max(y0, cy * CHUNK_SIZE);
+      auto bottom = std::min({y1, rows, (cy + 1) * CHUNK_SIZE});
+      for (auto y = top; y < bottom; ++y) {
+        for (auto x = left; x < right; ++x) {
+          auto tile =
+              current.tiles[(y % CHUNK_SIZE) * CHUNK_SIZE + x % CHUNK_SIZE];
+          if (tile != Tile::EMPTY)
+            visitor(x, y, tile);
+        }
+      }
+    });
+  }
+
+private:
+  struct Chunk {
+    std::array<Tile, CHUNK_SIZE * CHUNK_SIZE> tiles;
+    int count; // non-empty tiles
+  };
+
+  int columns, rows;
+  int stride; // chunks per row
+  std::vector<std::unique_ptr<Chunk>> chunks; // null while empty
+
+  std::unique_ptr<Chunk> &chunk(int x, int y);
+  const Chunk *chunk(int x, int y) const;
+};
+
+#endif // TILEMAP_H
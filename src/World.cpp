@@ -1,6 +1,13 @@
 #include "World.hpp"
+#include "Level.hpp"
+#include "Profiler.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <random>
+#include <stdexcept>
 
 Uint32 get_pixel32(SDL_Surface *surface, int x, int y) {
   // Convert the pixels to 32 bit
@@ -13,20 +20,77 @@ Uint32 get_pixel32(SDL_Surface *surface, int x, int y) {
 // TODO: replace with template
 inline auto upscale(int a) { return a << SCALING_FACTOR; }
 
-World::World(const std::initializer_list<std::string> &paths)
-    : width{0}, height{0}, updated{false}, layers{0}, tree{1.0f, 256} {
-  for (auto const &i : paths)
-    load_tiles(layers++, i);
-  // Temporary entity with camera focus:
+// Runs a single system or load stage and adds its wall time to the counter
+template <typename Func>
+void timed(std::chrono::nanoseconds &time, Func func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  time += std::chrono::steady_clock::now() - start;
+}
+
+World::World(const std::vector<Layer> &level, unsigned int threads)
+    : width{0}, height{0}, updated{false}, tree{1.0f, 256},
+      statics{0.0f, 256}, layers{0}, show_tree{false}, jobs{threads} {
+  for (auto const &i : level) {
+    auto start = std::chrono::steady_clock::now();
+    auto scanned = scan_layer(i, jobs);
+    loading.scan += std::chrono::steady_clock::now() - start;
+    load_tiles(layers++, std::move(scanned));
+  }
+  timed(loading.spawn, [&] { spawn_bodies(true); });
+  timed(loading.trees, [&] { build_trees(); });
+  create_focus();
+}
+
+World::World(const LevelFile &level, bool stream, unsigned int threads)
+    : width{0}, height{0}, updated{false}, tree{1.0f, 256},
+      statics{0.0f, 256}, layers{0}, show_tree{false}, jobs{threads} {
+  if (!stream) {
+    for (auto const &i : level.layers())
+      load_tiles(layers++, level, i);
+    timed(loading.spawn, [&] { spawn_bodies(true); });
+    timed(loading.trees, [&] { build_trees(); });
+    create_focus();
+    return;
+  }
+
+  width = upscale(level.width());
+  height = upscale(level.height());
+  for (; layers < (int)level.layers().size(); ++layers)
+    tilemaps.emplace_back(level.width(), level.height());
+  stream_columns = level.chunk_columns();
+  streamed.resize((std::size_t)stream_columns * level.chunk_rows());
+  create_focus();
+  streamer = std::make_unique<Streamer>(level);
+  // Chunks around the start are read right away, there is nothing to show
+  // without them
+  stream_chunks(true);
+}
+
+// Bodies of all layers go into the trees in one pass
+void World::build_trees() {
+  PROFILE_SCOPE("World::build_trees");
+  for (auto [target, leaves] : {std::pair{&tree, &staged},
+                                std::pair{&statics, &staged_statics}}) {
+    auto nodes = target->build(*leaves);
+    for (auto i = 0u; i < nodes.size(); ++i)
+      registry.get<body>((*leaves)[i].first).node = nodes[i];
+    leaves->clear();
+    leaves->shrink_to_fit();
+  }
+}
+
+// Temporary entity with camera focus
+void World::create_focus() {
   const auto entity = registry.create();
   registry.emplace<position>(entity, geom::Point{.0f, .0f});
+  registry.emplace<last_position>(entity, geom::Point{.0f, .0f});
   registry.emplace<body>(
       entity,
       tree.add(entity, aabb::AABB{(float)upscale(0), (float)upscale(0),
                                   (float)upscale(1), (float)upscale(1)}),
       .1f, true);
   registry.emplace<velocity>(entity, geom::Vector{.0f, .0f});
-  registry.emplace<acceleration>(entity, geom::Vector{.0f, .0f});
   registry.emplace<force>(entity, geom::Vector{.0f, .0f});
   registry.emplace<focus>(entity, true);
   registry.emplace<sprite>(entity,
@@ -39,110 +103,353 @@ World::World(const std::initializer_list<std::string> &paths)
                            1);
 }
 
-void World::load_tiles(int layer, const std::string &path) {
+Layer read_layer(const std::string &path) {
+  PROFILE_SCOPE("read_layer");
+  Layer level{0, 0, {}};
   if (SDL_Surface *image = IMG_Load(path.c_str())) {
-    width = upscale(image->w);
-    height = upscale(image->h);
-    for (auto y = 0; y < image->w; ++y) {
-      for (auto x = 0; x < image->h; ++x) {
-        auto pos = geom::Point{(float)upscale(x), (float)upscale(y)};
-        auto dim = geom::Point{(float)upscale(1), (float)upscale(1)};
-        switch (get_pixel32(image, x, y)) {
-        case STONE_PIXEL: // stone
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<body>(entity, tree.add(entity, aabb::AABB{pos, dim}),
-                                 .0f, true);
-          registry.emplace<velocity>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<acceleration>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<force>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{16, 0, upscale(1), upscale(1)}, layer);
-          break;
-        }
-        case GRASS_PIXEL: // grass
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{32, 0, upscale(1), upscale(1)}, layer);
-          break;
-        }
-        case WATER_PIXEL: // water
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{0, 32, upscale(1), upscale(1)}, layer);
-          break;
-        }
-        case SAND_PIXEL: // sand
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{48, 0, upscale(1), upscale(1)}, layer);
-          break;
-        }
-        case BRICK_PIXEL: // brick
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<body>(entity, tree.add(entity, aabb::AABB{pos, dim}),
-                                 .0f, true);
-          registry.emplace<velocity>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<acceleration>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<force>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{64, 0, upscale(1), upscale(1)}, layer);
-          break;
-        }
-        case CRATE_PIXEL: // crate
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<body>(entity, tree.add(entity, aabb::AABB{pos, dim}),
-                                 .02f, true);
-          registry.emplace<velocity>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<acceleration>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<force>(entity, geom::Vector{.0f, .0f});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{80, 0, upscale(1), upscale(1)}, layer);
-          break;
-        }
-        case LAVA_PIXEL: // lava
-        {
-          const auto entity = registry.create();
-          registry.emplace<position>(entity, geom::Point{pos});
-          registry.emplace<sprite>(
-              entity, SDL_Rect{0, 48, upscale(1), upscale(1)}, layer);
-          break;
+    level.width = image->w;
+    level.height = image->h;
+    level.pixels.reserve(image->w * image->h);
+    for (auto y = 0; y < image->h; ++y) {
+      for (auto x = 0; x < image->w; ++x) {
+        level.pixels.push_back(get_pixel32(image, x, y));
+      }
+    }
+    SDL_FreeSurface(image);
+  }
+  return level;
+}
+
+// Pixels are scanned row by row into a row of chunks, which then go into
+// the tilemap whole. Every chunk row keeps its own bodies until they are
+// joined in order, so the result doesn't depend on the threads.
+ScannedLayer scan_layer(const Layer &level, Jobs &jobs) {
+  PROFILE_SCOPE("scan_layer");
+  // Bodies keep their tile coordinates in 16 bits
+  if (level.width > 0xFFFF || level.height > 0xFFFF)
+    throw std::runtime_error(
+        "layer of " + std::to_string(level.width) + "x" +
+        std::to_string(level.height) + " tiles, at most 65535 per side");
+  ScannedLayer scanned{Tilemap{level.width, level.height}, {}};
+  auto &tiles = scanned.tiles;
+  constexpr auto CHUNK_TILES = CHUNK_SIZE * CHUNK_SIZE;
+  std::vector<std::vector<CookedBody>> found(tiles.chunk_rows());
+  jobs.parallel_for(found.size(), [&](auto begin, auto end, auto) {
+    std::vector<Tile> row(tiles.chunk_columns() * CHUNK_TILES);
+    for (auto cy = (int)begin; cy < (int)end; ++cy) {
+      std::fill(row.begin(), row.end(), Tile::EMPTY);
+      auto bottom = std::min(level.height, (cy + 1) * CHUNK_SIZE);
+      for (auto y = cy * CHUNK_SIZE; y < bottom; ++y) {
+        auto *pixels = &level.pixels[y * level.width];
+        // Neighbours often share a color
+        auto kind = pixel_kind(pixels[0]);
+        for (auto x = 0; x < level.width; ++x) {
+          if (pixels[x] != kind.pixel)
+            kind = pixel_kind(pixels[x]);
+          auto [pixel, tile, archetype] = kind;
+          if (archetype == Archetype::DECOR) {
+            if (tile == Tile::EMPTY)
+              continue;
+          } else {
+            found[cy].push_back(
+                CookedBody{(std::uint16_t)x, (std::uint16_t)y, tile, 0});
+            if (archetype == Archetype::CRATE)
+              continue;
+          }
+          row[(x / CHUNK_SIZE) * CHUNK_TILES + (y % CHUNK_SIZE) * CHUNK_SIZE +
+              x % CHUNK_SIZE] = tile;
         }
-        default: // void
-          break;
+      }
+      for (auto cx = 0; cx < tiles.chunk_columns(); ++cx)
+        tiles.set_chunk(cx, cy, &row[cx * CHUNK_TILES]);
+    }
+  });
+  std::size_t count = 0;
+  for (auto &bodies : found)
+    count += bodies.size();
+  scanned.bodies.reserve(count);
+  for (auto &bodies : found)
+    scanned.bodies.insert(scanned.bodies.end(), bodies.begin(), bodies.end());
+  return scanned;
+}
+
+// Walls and crates become bodies, every tile but crates is drawn from the
+// layer's tilemap
+void World::load_tiles(int layer, ScannedLayer &&scanned) {
+  width = upscale(scanned.tiles.width());
+  height = upscale(scanned.tiles.height());
+  tilemaps.push_back(std::move(scanned.tiles));
+  spawns.reserve(spawns.size() + scanned.bodies.size());
+  for (auto &spawn : scanned.bodies)
+    spawns.push_back({layer, spawn});
+}
+
+// Chunks are copied whole and bodies come precomputed, in the same order
+// as from the pixel scan
+void World::load_tiles(int layer, const LevelFile &level,
+                       const CookedLayer &cooked) {
+  PROFILE_SCOPE("World::load_tiles");
+  width = upscale(level.width());
+  height = upscale(level.height());
+  auto &tiles = tilemaps.emplace_back(level.width(), level.height());
+  auto *chunk = cooked.chunks;
+  for (auto cy = 0; cy < tiles.chunk_rows(); ++cy) {
+    for (auto cx = 0; cx < tiles.chunk_columns(); ++cx) {
+      tiles.set_chunk(cx, cy, chunk);
+      chunk += CHUNK_SIZE * CHUNK_SIZE;
+    }
+  }
+  for (auto i = 0u; i < cooked.body_count; ++i)
+    spawns.push_back({layer, cooked.bodies[i]});
+}
+
+// Creates the spawned bodies archetype by archetype. A counting pass sizes
+// the temporaries, then entities are created and each component is added
+// with one range call. Bulk loads size every pool once as well, streamed
+// chunks leave the pools to grow on their own since an exact reserve per
+// chunk would copy them on every one.
+void World::spawn_bodies(bool bulk) {
+  PROFILE_SCOPE("World::spawn_bodies");
+  std::vector<position> walls, crates;
+  std::vector<sprite> sprites;
+  auto crate_count = (std::size_t)std::count_if(
+      spawns.begin(), spawns.end(), [](auto &spawn) {
+        return tile_archetype(spawn.second.tile) == Archetype::CRATE;
+      });
+  walls.reserve(spawns.size() - crate_count);
+  crates.reserve(crate_count);
+  sprites.reserve(crate_count);
+  for (auto &[layer, spawn] : spawns) {
+    auto pos = position{geom::Point{(float)upscale(spawn.x),
+                                    (float)upscale(spawn.y)}};
+    if (tile_archetype(spawn.tile) == Archetype::CRATE) {
+      crates.push_back(pos);
+      sprites.push_back({tile_sprite(Tile::CRATE), layer});
+    } else {
+      walls.push_back(pos);
+    }
+  }
+  spawns.clear();
+
+  if (bulk) {
+    auto bodies = registry.view<body>().size();
+    auto moving = registry.view<velocity>().size();
+    registry.reserve<position, body>(bodies + walls.size() + crates.size());
+    registry.reserve<last_position, velocity, force, sprite>(
+        moving + crates.size());
+  }
+  auto dim = geom::Point{(float)upscale(1), (float)upscale(1)};
+
+  std::vector<entt::entity> entities(walls.size());
+  registry.create(entities.begin(), entities.end());
+  registry.insert<position>(entities.begin(), entities.end(), walls.begin());
+  registry.insert<body>(entities.begin(), entities.end(),
+                        body{NULL_NODE, .0f, false});
+  staged_statics.reserve(staged_statics.size() + walls.size());
+  for (auto i = 0u; i < walls.size(); ++i)
+    staged_statics.push_back({entities[i], aabb::AABB{walls[i], dim}});
+
+  spawned_crates.resize(crates.size());
+  auto first = spawned_crates.begin(), last = spawned_crates.end();
+  registry.create(first, last);
+  registry.insert<position>(first, last, crates.begin());
+  std::vector<last_position> lasts;
+  lasts.reserve(crates.size());
+  for (auto &pos : crates)
+    lasts.push_back({pos});
+  registry.insert<last_position>(first, last, lasts.begin());
+  registry.insert<body>(first, last, body{NULL_NODE, .02f, true});
+  registry.insert<velocity>(first, last, velocity{geom::Vector{.0f, .0f}});
+  registry.insert<force>(first, last, force{geom::Vector{.0f, .0f}});
+  registry.insert<sprite>(first, last, sprites.begin());
+  staged.reserve(staged.size() + crates.size());
+  for (auto i = 0u; i < crates.size(); ++i)
+    staged.push_back({spawned_crates[i], aabb::AABB{crates[i], dim}});
+}
+
+// Leaves of a streamed chunk are few next to a tree's, so they go in one
+// by one. Bulk building would stack every chunk's subtree on the root.
+void World::insert_staged() {
+  for (auto [target, leaves] : {std::pair{&tree, &staged},
+                                std::pair{&statics, &staged_statics}}) {
+    for (auto &[entity, aabb] : *leaves)
+      registry.get<body>(entity).node = target->add(entity, aabb);
+    leaves->clear();
+  }
+}
+
+// Unloads far chunks, requests the missing ones nearest first and inserts
+// what the loader has finished within the budget. Waiting reads the
+// missing chunks on this thread instead.
+void World::stream_chunks(bool wait) {
+  PROFILE_SCOPE("World::stream_chunks");
+  auto rows = (int)streamed.size() / stream_columns;
+  auto fx = 0, fy = 0;
+  auto view = registry.view<position, focus>();
+  view.each([&](auto &pos, auto &focus) {
+    if (focus) {
+      auto span = (float)upscale(CHUNK_SIZE);
+      fx = std::clamp((int)std::floor(pos.x / span), 0, stream_columns - 1);
+      fy = std::clamp((int)std::floor(pos.y / span), 0, rows - 1);
+    }
+  });
+  auto distance = [&](int number) {
+    return std::max(std::abs(number % stream_columns - fx),
+                    std::abs(number / stream_columns - fy));
+  };
+
+  // A chunk dropped while pending is ignored when it arrives
+  resident.erase(std::remove_if(resident.begin(), resident.end(),
+                                [&](int number) {
+                                  if (distance(number) <= unload_radius)
+                                    return false;
+                                  auto &current = streamed[number];
+                                  if (current.state == ChunkState::LOADED)
+                                    unload_chunk(number % stream_columns,
+                                                 number / stream_columns);
+                                  current.state = ChunkState::UNLOADED;
+                                  return true;
+                                }),
+                 resident.end());
+
+  for (auto ring = 0; ring <= load_radius; ++ring) {
+    for (auto cy = std::max(fy - ring, 0); cy <= std::min(fy + ring, rows - 1);
+         ++cy) {
+      for (auto cx = std::max(fx - ring, 0);
+           cx <= std::min(fx + ring, stream_columns - 1); ++cx) {
+        auto number = cy * stream_columns + cx;
+        if (distance(number) != ring ||
+            streamed[number].state != ChunkState::UNLOADED)
+          continue;
+        resident.push_back(number);
+        if (wait) {
+          load_chunk(streamer->read(cx, cy));
+          streamed[number].state = ChunkState::LOADED;
+        } else {
+          streamer->request(cx, cy);
+          streamed[number].state = ChunkState::PENDING;
         }
       }
     }
   }
+
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < stream_budget &&
+         streamer->poll(arrived)) {
+    auto &current = streamed[arrived.cy * stream_columns + arrived.cx];
+    if (current.state != ChunkState::PENDING)
+      continue;
+    load_chunk(arrived);
+    current.state = ChunkState::LOADED;
+  }
+}
+
+void World::load_chunk(const Streamer::Chunk &chunk) {
+  auto number = (unsigned int)(chunk.cy * stream_columns + chunk.cx);
+  for (auto layer = 0; layer < layers; ++layer) {
+    tilemaps[layer].set_chunk(chunk.cx, chunk.cy, chunk.tiles[layer].data());
+    for (auto &current : chunk.bodies[layer])
+      spawns.push_back({layer, current});
+  }
+  spawn_bodies(false);
+  registry.insert<streamed_from>(spawned_crates.begin(), spawned_crates.end(),
+                                 streamed_from{number});
+  insert_staged();
 }
 
-void World::update(Render &render) {
-  handle_input();
-  calc_acceleration();
-  calc_velocity();
-  calc_position();
-  detect_collisions();
-  focus_camera(render);
-  render_entities(render);
+// Walls never move and go by position, leaves of neighbours touch the
+// chunk's edges. Crates go with the chunk they were loaded with, wherever
+// they were pushed since, so none is left behind in a chunk that is never
+// loaded or unloaded.
+void World::unload_chunk(int cx, int cy) {
+  for (auto &tiles : tilemaps)
+    tiles.clear_chunk(cx, cy);
+
+  auto span = (float)upscale(CHUNK_SIZE);
+  aabb::AABB region{cx * span, cy * span, span, span};
+  doomed.clear();
+  statics.query(region, [&](unsigned int node) {
+    auto &pos = registry.get<position>(statics.id(node));
+    if ((int)std::floor(pos.x / span) == cx &&
+        (int)std::floor(pos.y / span) == cy)
+      doomed.push_back(statics.id(node));
+  });
+  for (auto entity : doomed) {
+    statics.remove(registry.get<body>(entity).node);
+    registry.destroy(entity);
+  }
+
+  auto number = (unsigned int)(cy * stream_columns + cx);
+  doomed.clear();
+  registry.view<streamed_from>().each([&](auto entity, auto &from) {
+    if (from.chunk == number)
+      doomed.push_back(entity);
+  });
+  for (auto entity : doomed) {
+    tree.remove(registry.get<body>(entity).node);
+    registry.destroy(entity);
+  }
+}
+
+void World::update() {
+  if (streamer)
+    timed(timings.streaming, [&] { stream_chunks(false); });
+  timed(timings.integration, [&] { integrate(); });
+  timed(timings.collisions, [&] { detect_collisions(); });
+  timed(timings.settling, [&] { settle_bodies(); });
+}
+
+void World::render(Render &render, float alpha) {
+  focus_camera(render, alpha);
+  render_entities(render, alpha);
   if (show_tree)
     render_tree(render);
 }
 
+// Gives every dynamic body a random velocity, reproducible by seed
+void World::kick(float speed, unsigned int seed) {
+  std::mt19937 engine{seed};
+  std::uniform_real_distribution<float> distribution{-speed, speed};
+  // Waking moves components around in their pools, so it goes first
+  auto sleeping = registry.view<asleep>();
+  std::vector<entt::entity> woken(sleeping.begin(), sleeping.end());
+  for (auto entity : woken)
+    wake(entity);
+  auto view = registry.view<velocity, body>();
+  view.each([&](auto &vel, auto &bod) {
+    if (bod.inverse_mass > 0) {
+      vel.x = distribution(engine);
+      vel.y = distribution(engine);
+      bod.moved = true;
+    }
+  });
+}
+
+std::size_t World::bodies() { return registry.view<body>().size(); }
+
+std::size_t World::sleeping() { return registry.view<asleep>().size(); }
+
+// FNV-1a hash of all body positions, used to compare simulation runs
+std::uint64_t World::digest() {
+  std::uint64_t hash = 0xcbf29ce484222325;
+  auto view = registry.view<position, body>();
+  view.each([&](auto &pos, auto &) {
+    for (auto value : {pos.x, pos.y}) {
+      std::uint32_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      for (auto i = 0; i < 4; ++i) {
+        hash ^= (bits >> (i * 8)) & 0xFF;
+        hash *= 0x100000001b3;
+      }
+    }
+  });
+  return hash;
+}
+
 void World::handle_input() {
   auto view = registry.view<force, focus>();
   SDL_Event event;
-  view.each([&](auto &force, auto &focus) {
+  view.each([&](auto entity, auto &force, auto &) {
     while (SDL_PeepEvents(&event, 1, SDL_GETEVENT, SDL_KEYDOWN, SDL_KEYUP) >
            0) {
       switch (event.type) {
@@ -167,6 +474,10 @@ void World::handle_input() {
         case SDLK_p:
           tree.print();
           break;
+        case SDLK_F12:
+          if (profile::enabled)
+            profile::write_trace("trace.json");
+          break;
         default:
           break;
         }
@@ -204,56 +515,277 @@ void World::handle_input() {
         break;
       }
     }
+    if (force != geom::Vector{.0f, .0f})
+      wake(entity);
   });
 }
 
-void World::calc_acceleration() {
-  auto view = registry.view<body, acceleration, force>();
-  view.each([&](auto &body, auto &acc, auto &force) {
-    acc = {force * body.inverse_mass};
-  });
+void World::threads(unsigned int count, bool deterministic) {
+  jobs.start(count);
+  jobs.deterministic = deterministic;
 }
 
-void World::calc_velocity() {
-  auto view = registry.view<velocity, acceleration>();
-  view.each([&](auto &vel, auto &acc) {
-    vel *= 0.9f; // TODO: remove slowdown, use friction instead
-    vel += acc;
-  });
+void World::count_trees(bool enabled) {
+  tree.count_work(enabled);
+  statics.count_work(enabled);
 }
 
-void World::calc_position() {
-  auto view = registry.view<position, velocity, body>();
-  view.each([&](auto &pos, auto &vel, auto &body) {
-    pos += vel;
-    tree[body.node].aabb.pos += vel;
-    if (vel != geom::Vector{.0f, .0f})
-      body.moved = true;
+std::pair<aabb::TreeStats, aabb::TreeStats> World::take_tree_stats() {
+  return {tree.take_stats(), statics.take_stats()};
+}
+
+// Awake dynamic bodies, their hot components are owned by the group and
+// kept packed in the same order
+auto World::integrated() {
+  return registry.group<position, last_position, velocity, force, body>(
+      entt::exclude<asleep>);
+}
+
+// Force, velocity and position in one pass, split across the job pool.
+// Leaves are moved in place, which is safe from several threads since every
+// body owns its leaf and the tree doesn't change shape until the refit. The
+// position left by the previous tick is kept for drawing.
+void World::integrate() {
+  PROFILE_SCOPE("World::integrate");
+  auto group = integrated();
+  batch.assign(group.begin(), group.end());
+  jobs.parallel_for(batch.size(), [&](auto begin, auto end, auto) {
+    for (auto i = begin; i < end; ++i) {
+      auto [pos, last, vel, push, bod] =
+          group.template get<position, last_position, velocity, force, body>(
+              batch[i]);
+      vel *= 0.9f; // TODO: remove slowdown, use friction instead
+      vel += push * bod.inverse_mass;
+      last = {pos};
+      auto &box = tree.aabb(bod.node);
+      geom::Vector<float> move = vel;
+      auto reach = std::min(box.dim.x, box.dim.y) * SWEEP_FRACTION;
+      if (move * move > reach * reach)
+        move = sweep_walls(box, move);
+      pos += move;
+      box.pos += move;
+      if (vel != geom::Vector{.0f, .0f})
+        bod.moved = true;
+    }
   });
 }
 
+// Part of the move a box can make before it hits a wall. The rest of the
+// move slides along the wall, as projection_correct would push it out
+// sideways. The velocity is left alone for walls there too.
+geom::Vector<float> World::sweep_walls(const aabb::AABB &box,
+                                       geom::Vector<float> move) const {
+  PROFILE_SCOPE("World::sweep_walls");
+  auto moved = geom::Vector{.0f, .0f};
+  for (auto slide = 0; slide <= MAX_SLIDES; ++slide) {
+    auto hit = statics.sweep(aabb::AABB{box.pos + moved, box.dim}, move);
+    if (hit.node == NULL_NODE)
+      return moved + move;
+    moved += move * hit.t;
+    move *= 1 - hit.t;
+    if (hit.normal.x != 0)
+      move.x = 0;
+    else
+      move.y = 0;
+  }
+  return moved;
+}
+
+// Runs in three steps: contacts of all moved bodies are gathered in
+// parallel without touching any body, then split into islands of bodies
+// that touch each other, and islands are resolved in parallel. Walls are
+// never written, so they don't join islands. Contacts keep the order of
+// the pair list and of the body view, and islands the order of their first
+// contact, so the outcome doesn't depend on the number of threads. Sleeping
+// bodies are only met as the other body of a contact, which wakes them.
 void World::detect_collisions() {
-  tree.update();
+  PROFILE_SCOPE("World::detect_collisions");
+  auto awake = registry.view<velocity, body>(entt::exclude<asleep>);
+  refit.clear();
+  for (auto entity : awake)
+    refit.push_back(awake.get<body>(entity).node);
+  tree.update(refit);
+  gather_contacts();
+  build_islands();
+
   auto view = registry.view<position, velocity, body>();
-  view.each([&](auto &pos, auto &vel, auto &bod) {
-    if (bod.moved) {
-      std::vector<entt::entity> collisions = tree.query(bod.node);
-      if (collisions.empty()) {
-        bod.moved = false;
-      } else {
-        for (auto &entity : collisions) {
-          auto &pos1 = view.get<position>(entity);
-          auto &vel1 = view.get<velocity>(entity);
-          auto &bod1 = view.get<body>(entity);
-          projection_correct(pos, pos1, tree[bod.node].aabb,
-                             tree[bod1.node].aabb, bod, bod1);
-          if (bod1.inverse_mass > 0)
-            impulse_correct(tree[bod.node].aabb, tree[bod1.node].aabb, vel,
-                            vel1, bod, bod1);
-        }
-      }
+  jobs.parallel_for(islands.size() - 1, [&](auto begin, auto end, auto) {
+    for (auto island = begin; island < end; ++island) {
+      for (auto i = islands[island]; i < islands[island + 1]; ++i)
+        resolve_contact(view, ordered[i]);
     }
   });
+
+  // Moved bodies stay awake only while they touch something
+  awake.each([](auto &, auto &bod) { bod.moved = false; });
+  for (auto &contact : ordered) {
+    if (!contact.resolved)
+      continue;
+    if (contact.moved[0])
+      view.get<body>(tree.id(contact.node)).moved = true;
+    if (contact.moved[1])
+      view.get<body>(tree.id(contact.other)).moved = true;
+    else if (!contact.wall)
+      wake(tree.id(contact.other));
+  }
+}
+
+// Puts bodies to sleep that were slow for long enough. They stop where
+// they are, so their leaves get a last refit as resolving may have moved
+// them since the one of this tick.
+void World::settle_bodies() {
+  PROFILE_SCOPE("World::settle_bodies");
+  auto view = registry.view<velocity, force, body>(entt::exclude<asleep>);
+  sleepers.clear();
+  for (auto entity : view) {
+    auto [vel, push, bod] = view.get<velocity, force, body>(entity);
+    if (push != geom::Vector{.0f, .0f} ||
+        vel * vel >= SLEEP_SPEED * SLEEP_SPEED) {
+      bod.resting = 0;
+    } else if (++bod.resting >= SLEEP_TICKS) {
+      sleepers.push_back(entity);
+    }
+  }
+
+  refit.clear();
+  for (auto entity : sleepers) {
+    auto [pos, last, vel, bod] =
+        registry.get<position, last_position, velocity, body>(entity);
+    last = {pos};
+    vel = {geom::Vector{.0f, .0f}};
+    bod.moved = false;
+    refit.push_back(bod.node);
+    registry.emplace<asleep>(entity);
+  }
+  tree.update(refit);
+}
+
+void World::wake(entt::entity entity) {
+  registry.remove<asleep>(entity);
+  registry.get<body>(entity).resting = 0;
+}
+
+// Bodies are paired with each other by one overlaps() pass over the
+// dynamic tree, which is then cut into chunks that keep the pairs with a
+// moving body. Walls live in the static tree, so every moving body queries
+// it on its own. A pair of moving bodies goes first by the lower node.
+void World::gather_contacts() {
+  PROFILE_SCOPE("World::gather_contacts");
+  auto bodies = registry.view<body>();
+  tree.overlaps(pairs);
+  found.resize(std::max<std::size_t>(found.size(), jobs.chunks(pairs.size())));
+  jobs.parallel_for(pairs.size(), [&](auto begin, auto end, auto chunk) {
+    auto &out = found[chunk];
+    out.clear();
+    for (auto i = begin; i < end; ++i) {
+      auto [n0, n1] = pairs[i];
+      auto moved0 = bodies.get<body>(tree.id(n0)).moved;
+      auto moved1 = bodies.get<body>(tree.id(n1)).moved;
+      if (moved0 && (!moved1 || n0 < n1))
+        out.push_back({n0, n1, false, {true, moved1}, false});
+      else if (moved1)
+        out.push_back({n1, n0, false, {true, moved0}, false});
+    }
+  });
+  contacts.clear();
+  for (auto chunk = 0u; chunk < jobs.chunks(pairs.size()); ++chunk)
+    contacts.insert(contacts.end(), found[chunk].begin(), found[chunk].end());
+
+  auto view = registry.view<position, velocity, body>(entt::exclude<asleep>);
+  batch.assign(view.begin(), view.end());
+  found.resize(std::max<std::size_t>(found.size(), jobs.chunks(batch.size())));
+  jobs.parallel_for(batch.size(), [&](auto begin, auto end, auto chunk) {
+    auto &out = found[chunk];
+    out.clear();
+    for (auto i = begin; i < end; ++i) {
+      auto &bod = view.get<body>(batch[i]);
+      if (!bod.moved)
+        continue;
+      statics.query(tree.aabb(bod.node), [&](unsigned int node) {
+        out.push_back({bod.node, node, true, {true, false}, false});
+      });
+    }
+  });
+  for (auto chunk = 0u; chunk < jobs.chunks(batch.size()); ++chunk)
+    contacts.insert(contacts.end(), found[chunk].begin(), found[chunk].end());
+}
+
+// Union-find over the dynamic nodes, then a counting sort of the contacts
+// by island that keeps their order within each island
+void World::build_islands() {
+  PROFILE_SCOPE("World::build_islands");
+  auto size = 0u;
+  for (auto &contact : contacts) {
+    size = std::max(size, contact.node + 1);
+    if (!contact.wall)
+      size = std::max(size, contact.other + 1);
+  }
+  if (parents.size() < size)
+    parents.resize(size);
+  for (auto &contact : contacts) {
+    parents[contact.node] = contact.node;
+    if (!contact.wall)
+      parents[contact.other] = contact.other;
+  }
+  auto find = [&](unsigned int node) {
+    while (parents[node] != node)
+      node = parents[node] = parents[parents[node]];
+    return node;
+  };
+  for (auto &contact : contacts) {
+    if (!contact.wall)
+      parents[find(contact.node)] = find(contact.other);
+  }
+
+  // Number islands by first appearance, the label of a root is kept in
+  // labels and of a contact in its index
+  if (labels.size() < size)
+    labels.resize(size);
+  for (auto &contact : contacts)
+    labels[find(contact.node)] = NULL_NODE;
+  islands.assign(1, 0);
+  island_of.resize(contacts.size());
+  for (auto i = 0u; i < contacts.size(); ++i) {
+    auto &label = labels[find(contacts[i].node)];
+    if (label == NULL_NODE) {
+      label = islands.size() - 1;
+      islands.push_back(0);
+    }
+    island_of[i] = label;
+    ++islands[label + 1];
+  }
+  for (auto i = 1u; i < islands.size(); ++i)
+    islands[i] += islands[i - 1];
+
+  ordered.resize(contacts.size());
+  auto next = islands;
+  for (auto i = 0u; i < contacts.size(); ++i)
+    ordered[next[island_of[i]]++] = contacts[i];
+}
+
+template <typename View>
+void World::resolve_contact(View &view, Contact &contact) {
+  auto &box = tree.aabb(contact.node);
+  auto e0 = tree.id(contact.node);
+  if (contact.wall) {
+    // Earlier corrections this tick may have separated the pair
+    if (!box.overlaps(statics.aabb(contact.other)))
+      return;
+    projection_correct(view.template get<position>(e0), box,
+                       statics.aabb(contact.other));
+  } else {
+    auto &other = tree.aabb(contact.other);
+    if (!box.overlaps(other))
+      return;
+    auto e1 = tree.id(contact.other);
+    auto &b0 = view.template get<body>(e0);
+    auto &b1 = view.template get<body>(e1);
+    projection_correct(view.template get<position>(e0),
+                       view.template get<position>(e1), box, other, b0, b1);
+    impulse_correct(box, other, view.template get<velocity>(e0),
+                    view.template get<velocity>(e1), b0, b1);
+  }
+  contact.resolved = true;
 }
 
 void impulse_correct(const aabb::AABB &aabb1, const aabb::AABB &aabb2,
@@ -290,10 +822,33 @@ void projection_correct(position &p1, position &p2, aabb::AABB &aabb1,
   }
 }
 
-void World::focus_camera(Render &render) {
-  auto view = registry.view<position, focus>();
-  view.each([&](auto &pos, auto &focus) {
+// Pushes the body out of the wall along the axis of least penetration
+void projection_correct(position &p1, aabb::AABB &aabb1,
+                        const aabb::AABB &aabb2) {
+  auto overlap = aabb1.overlap(aabb2);
+  auto vector = aabb1.center() - aabb2.center();
+  if (std::abs(vector.x) < std::abs(vector.y)) {
+    auto delta = vector.y >= 0 ? overlap.dim.y : -overlap.dim.y;
+    p1.y += delta;
+    aabb1.pos.y += delta;
+  } else if (std::abs(vector.x) > std::abs(vector.y)) {
+    auto delta = vector.x >= 0 ? overlap.dim.x : -overlap.dim.x;
+    p1.x += delta;
+    aabb1.pos.x += delta;
+  }
+}
+
+// Where a body is drawn, alpha of the way from where the tick started
+geom::Point<float> blend(const last_position &last, const position &pos,
+                         float alpha) {
+  return last + (pos - last) * alpha;
+}
+
+void World::focus_camera(Render &render, float alpha) {
+  auto view = registry.view<position, last_position, focus>();
+  view.each([&](auto &current, auto &last, auto &focus) {
     if (focus) {
+      auto pos = blend(last, current, alpha);
       render.viewport.x = std::clamp<float>(pos.x - render.viewport.w * 0.5, 0,
                                             width - render.viewport.w);
       render.viewport.y = std::clamp<float>(pos.y - render.viewport.h * 0.5, 0,
@@ -302,29 +857,83 @@ void World::focus_camera(Render &render) {
   });
 }
 
-void World::render_entities(Render &render) {
-  auto view = registry.view<position, sprite>();
-  for (auto layer = 0; layer < layers; ++layer) {
-    view.each([&](auto &pos, auto &spr) {
-      if (spr.layer == layer)
-        render.update(
-            SDL_FRect{pos.x, pos.y, (float)upscale(1), (float)upscale(1)},
-            spr.tile);
-    });
+// Tile layers are culled by chunk and sprites by a region query on the
+// dynamic tree, so the cost follows what is on screen. Visible sprites are
+// sorted by layer and interleave with the tiles: tiles of a layer first,
+// then its sprites.
+void World::render_entities(Render &render, float alpha) {
+  PROFILE_SCOPE("World::render_entities");
+  auto &viewport = render.viewport;
+  auto x0 = (int)std::floor(viewport.x) >> SCALING_FACTOR;
+  auto y0 = (int)std::floor(viewport.y) >> SCALING_FACTOR;
+  auto x1 = ((int)std::ceil(viewport.x + viewport.w) >> SCALING_FACTOR) + 1;
+  auto y1 = ((int)std::ceil(viewport.y + viewport.h) >> SCALING_FACTOR) + 1;
+  auto span = (float)upscale(CHUNK_SIZE);
+
+  // Every sprite belongs to a body in the dynamic tree. Collisions may have
+  // pushed a leaf out of its fat box since the last refit, by less than a
+  // tile, and sprites are drawn up to a tick behind, so the region is grown
+  // by one.
+  auto tile = (float)upscale(1);
+  visible.clear();
+  tree.query(aabb::AABB{viewport.x - tile, viewport.y - tile,
+                        viewport.w + 2 * tile, viewport.h + 2 * tile},
+             [&](unsigned int node) {
+               if (auto *spr = registry.try_get<sprite>(tree.id(node)))
+                 visible.push_back({spr->layer, tree.id(node)});
+             });
+  std::sort(visible.begin(), visible.end());
+
+  auto current = visible.begin();
+  for (auto layer = 0; layer < layers || current != visible.end(); ++layer) {
+    // Static layers are drawn as cached chunks, the ones a chunk away from
+    // the viewport get painted ahead of time
+    if (layer < layers) {
+      auto &tiles = tilemaps[layer];
+      tiles.each_chunk(
+          x0 - CHUNK_SIZE, y0 - CHUNK_SIZE, x1 + CHUNK_SIZE, y1 + CHUNK_SIZE,
+          [&](int cx, int cy) {
+            auto key =
+                (std::uint64_t)layer << 48 | (std::uint64_t)cy << 24 | cx;
+            render.update_chunk(key,
+                                SDL_FRect{cx * span, cy * span, span, span},
+                                [&] { render_chunk(render, tiles, cx, cy); });
+          });
+    }
+    for (; current != visible.end() && current->first <= layer; ++current) {
+      auto [now, last, spr] =
+          registry.get<position, last_position, sprite>(current->second);
+      auto pos = blend(last, now, alpha);
+      render.update(
+          SDL_FRect{pos.x, pos.y, (float)upscale(1), (float)upscale(1)},
+          spr.tile);
+    }
   }
 }
 
+void World::render_chunk(Render &render, const Tilemap &tiles, int cx,
+                         int cy) {
+  tiles.each(cx * CHUNK_SIZE, cy * CHUNK_SIZE, (cx + 1) * CHUNK_SIZE,
+             (cy + 1) * CHUNK_SIZE, [&](int x, int y, Tile tile) {
+               render.update(SDL_FRect{(float)upscale(x), (float)upscale(y),
+                                       (float)upscale(1), (float)upscale(1)},
+                             tile_sprite(tile));
+             });
+}
+
 void World::render_tree(Render &render) {
-  for (auto i = 0; i < tree.size(); ++i) {
-    if (tree[i].is_leaf()) {
-      render.draw_frame(tree[i].aabb.pos.x, tree[i].aabb.pos.y,
-                        tree[i].aabb.pos.x + tree[i].aabb.dim.x,
-                        tree[i].aabb.pos.y + tree[i].aabb.dim.y, 0xFF00FF00);
-    } else {
-      render.draw_frame(tree[i].fatten.pos.x, tree[i].fatten.pos.y,
-                        tree[i].fatten.pos.x + tree[i].fatten.dim.x,
-                        tree[i].fatten.pos.y + tree[i].fatten.dim.y,
-                        0xFF0000FF);
-    }
+  for (auto *current : {&statics, &tree}) {
+    current->each([&](unsigned int node) {
+      if (current->is_leaf(node)) {
+        auto &aabb = current->aabb(node);
+        render.draw_frame(aabb.pos.x, aabb.pos.y, aabb.pos.x + aabb.dim.x,
+                          aabb.pos.y + aabb.dim.y, 0xFF00FF00);
+      } else {
+        auto fatten = current->fatten(node);
+        render.draw_frame(fatten.pos.x, fatten.pos.y,
+                          fatten.pos.x + fatten.dim.x,
+                          fatten.pos.y + fatten.dim.y, 0xFF0000FF);
+      }
+    });
   }
-}
\ No newline at end of file
+}
@@ -1,4 +1,10 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <chrono>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <entt/entt.hpp>
 
@@ -11,9 +17,23 @@
 
 #include "AABB.hpp"
 #include "Geometry.hpp"
+#include "Jobs.hpp"
+#include "Stream.hpp"
+#include "Tilemap.hpp"
 
 constexpr auto SCALING_FACTOR = 4;
 
+// Dynamic bodies without force that stay slower than SLEEP_SPEED, in
+// pixels per tick, for SLEEP_TICKS fall asleep
+constexpr auto SLEEP_SPEED = .05f;
+constexpr auto SLEEP_TICKS = 30;
+
+// Bodies moving more than this part of their size in a tick are swept
+// against the walls, overlap tests alone would let them pass through
+constexpr auto SWEEP_FRACTION = .5f;
+// Slides along walls after the first hit of a sweep
+constexpr auto MAX_SLIDES = 2;
+
 constexpr auto STONE_PIXEL = 0xFF555555;
 constexpr auto GRASS_PIXEL = 0xFF00FF00;
 constexpr auto WATER_PIXEL = 0xFFFF0000;
@@ -22,12 +42,53 @@ constexpr auto BRICK_PIXEL = 0xFF0000FF;
 constexpr auto CRATE_PIXEL = 0xFF004F7D;
 constexpr auto LAVA_PIXEL = 0xFF00AAFF;
 
+// Component sets a tile is loaded with: decor is only drawn from the
+// tilemap, walls are static bodies drawn from it too, crates are dynamic
+// bodies drawn as sprites
+enum class Archetype : Uint8 { DECOR, WALL, CRATE };
+
+struct TileKind {
+  Uint32 pixel;
+  Tile tile;
+  Archetype archetype;
+};
+
+// Layer pixel colors and what they load as, other colors are empty
+constexpr TileKind TILE_KINDS[] = {
+    {STONE_PIXEL, Tile::STONE, Archetype::WALL},
+    {GRASS_PIXEL, Tile::GRASS, Archetype::DECOR},
+    {WATER_PIXEL, Tile::WATER, Archetype::DECOR},
+    {SAND_PIXEL, Tile::SAND, Archetype::DECOR},
+    {BRICK_PIXEL, Tile::BRICK, Archetype::WALL},
+    {CRATE_PIXEL, Tile::CRATE, Archetype::CRATE},
+    {LAVA_PIXEL, Tile::LAVA, Archetype::DECOR},
+};
+
+constexpr TileKind pixel_kind(Uint32 pixel) {
+  for (auto &kind : TILE_KINDS) {
+    if (kind.pixel == pixel)
+      return kind;
+  }
+  return {pixel, Tile::EMPTY, Archetype::DECOR};
+}
+
+constexpr Tile pixel_tile(Uint32 pixel) { return pixel_kind(pixel).tile; }
+
+constexpr Archetype tile_archetype(Tile tile) {
+  for (auto &kind : TILE_KINDS) {
+    if (kind.tile == tile)
+      return kind.archetype;
+  }
+  return Archetype::DECOR;
+}
+
 // TODO: replace with transform
 class position : public geom::Point<float> {};
 
-class velocity : public geom::Vector<float> {};
+// Position at the start of the tick, frames are drawn between the two
+class last_position : public geom::Point<float> {};
 
-class acceleration : public geom::Vector<float> {};
+class velocity : public geom::Vector<float> {};
 
 class force : public geom::Vector<float> {};
 
@@ -35,47 +96,194 @@ struct body {
   unsigned int node;
   float inverse_mass; // Inverse mass
   bool moved;
+  int resting = 0; // ticks in a row spent slower than SLEEP_SPEED
 };
 
+// Dynamic body left out of integration and the tree refit until a contact,
+// input or a kick wakes it
+struct asleep {};
+
 using focus = bool;
 
+// Crate of a streamed level, by the number of the chunk it was loaded with
+struct streamed_from {
+  unsigned int chunk;
+};
+
 struct sprite {
   SDL_Rect tile;
   int layer;
 };
 
+// Decoded level layer, one *_PIXEL color per tile
+struct Layer {
+  int width, height;
+  std::vector<Uint32> pixels;
+};
+
+// Tiles of a layer and the bodies found on it, in the order of the scan
+struct ScannedLayer {
+  Tilemap tiles;
+  std::vector<CookedBody> bodies;
+};
+
+// Overlap of a moving body's leaf with another leaf of the dynamic tree or,
+// for walls, of the static one
+struct Contact {
+  unsigned int node, other;
+  bool wall;
+  bool moved[2]; // whether each body was moving when the pair was found
+  bool resolved;
+};
+
+// Wall time accumulated by each simulation system
+struct SystemTimes {
+  std::chrono::nanoseconds integration{0};
+  std::chrono::nanoseconds collisions{0};
+  std::chrono::nanoseconds streaming{0};
+  std::chrono::nanoseconds settling{0};
+};
+
+// Wall time of the stages of building the world from a level
+struct LoadTimes {
+  std::chrono::nanoseconds scan{0};
+  std::chrono::nanoseconds spawn{0};
+  std::chrono::nanoseconds trees{0};
+};
+
 class World {
 public:
   int width, height;
   bool updated;
 
-  World(const std::initializer_list<std::string> &paths);
+  // Layers are scanned in parallel, chunk row by chunk row. The systems
+  // run on threads workers, the calling thread included.
+  World(const std::vector<Layer> &level, unsigned int threads = 1);
+  // Streaming keeps only the chunks around the focus loaded, the level
+  // then has to outlive the world
+  World(const LevelFile &level, bool stream = false, unsigned int threads = 1);
   ~World(){};
 
-  void update(Render &render);
+  void handle_input();
+  void update();
+  // Draws the world alpha of the way from the previous tick to the last
+  void render(Render &render, float alpha = 1.0f);
+
+  void kick(float speed, unsigned int seed);
+  std::size_t bodies();
+  std::size_t sleeping();
+  std::uint64_t digest();
+  const SystemTimes &times() const { return timings; };
+  void reset_times() { timings = {}; };
+  const LoadTimes &load_times() const { return loading; };
+  // Threads of the integration systems, deterministic mode keeps results
+  // independent of their number
+  void threads(unsigned int count, bool deterministic);
+  const aabb::Tree &dynamic_tree() const { return tree; };
+  const aabb::Tree &static_tree() const { return statics; };
+
+  // Chunks within load_radius of the focus' chunk are streamed in, ones
+  // past unload_radius are dropped. Loaded chunks get inserted until the
+  // budget of the tick is spent.
+  int load_radius = 3;
+  int unload_radius = 5;
+  std::chrono::microseconds stream_budget{2000};
+  // Broad phase counters of the dynamic and the static tree, taking them
+  // starts the next count
+  void count_trees(bool enabled);
+  std::pair<aabb::TreeStats, aabb::TreeStats> take_tree_stats();
 
 private:
   entt::registry registry;
+  // Moving bodies, walls never move and are only queried
   aabb::Tree tree;
+  aabb::Tree statics;
+  // Broad phase pairs of the dynamic tree, found in one pass per tick
+  aabb::PairList pairs;
+  // Narrow phase: contacts found per chunk and merged, union-find parents
+  // and island labels by node, island of every contact, contacts sorted by
+  // island and where each island starts in them
+  std::vector<std::vector<Contact>> found;
+  std::vector<Contact> contacts;
+  std::vector<unsigned int> parents;
+  std::vector<unsigned int> labels;
+  std::vector<unsigned int> island_of;
+  std::vector<Contact> ordered;
+  std::vector<unsigned int> islands;
+  // Bodies read by load_tiles by layer, waiting for spawn_bodies, and the
+  // crates it created last
+  std::vector<std::pair<int, CookedBody>> spawns;
+  std::vector<entt::entity> spawned_crates;
+  // Leaves of spawned bodies, waiting for the bulk build
+  std::vector<std::pair<entt::entity, aabb::AABB>> staged;
+  std::vector<std::pair<entt::entity, aabb::AABB>> staged_statics;
+  // Layer and entity of the sprites under the viewport
+  std::vector<std::pair<int, entt::entity>> visible;
   int layers;
+  std::vector<Tilemap> tilemaps;
   bool show_tree;
+  SystemTimes timings;
+  LoadTimes loading;
+  Jobs jobs;
+  std::vector<entt::entity> batch; // entities of the running parallel system
+  // Leaves of the awake bodies, the only ones the refit looks at, and the
+  // bodies falling asleep
+  std::vector<unsigned int> refit;
+  std::vector<entt::entity> sleepers;
 
-  void load_tiles(int layer, const std::string &path);
-  void handle_input();
-  void calc_acceleration();
-  void calc_velocity();
-  void calc_position();
+  // Level streaming, every chunk is unloaded, requested from the loader or
+  // loaded. A chunk's crates live exactly as long as it is loaded.
+  enum class ChunkState : Uint8 { UNLOADED, PENDING, LOADED };
+  struct StreamedChunk {
+    ChunkState state = ChunkState::UNLOADED;
+  };
+  std::unique_ptr<Streamer> streamer;
+  int stream_columns = 0;
+  std::vector<StreamedChunk> streamed;
+  std::vector<int> resident; // numbers of pending and loaded chunks
+  Streamer::Chunk arrived;
+  std::vector<entt::entity> doomed;
+
+  void build_trees();
+  void create_focus();
+  void load_tiles(int layer, ScannedLayer &&scanned);
+  void load_tiles(int layer, const LevelFile &level,
+                  const CookedLayer &cooked);
+  void spawn_bodies(bool bulk);
+  void insert_staged();
+  void stream_chunks(bool wait);
+  void load_chunk(const Streamer::Chunk &chunk);
+  void unload_chunk(int cx, int cy);
+  auto integrated();
+  void integrate();
+  geom::Vector<float> sweep_walls(const aabb::AABB &box,
+                                  geom::Vector<float> move) const;
   void detect_collisions();
-  void focus_camera(Render &render);
-  void render_entities(Render &render);
+  void gather_contacts();
+  void build_islands();
+  template <typename View> void resolve_contact(View &view, Contact &contact);
+  void settle_bodies();
+  void wake(entt::entity entity);
+  void focus_camera(Render &render, float alpha);
+  void render_entities(Render &render, float alpha);
+  void render_chunk(Render &render, const Tilemap &tiles, int cx, int cy);
   void render_tree(Render &render);
 };
 
+Layer read_layer(const std::string &path);
+// Scans the pixels of a layer into tiles and bodies, chunk rows are spread
+// over the jobs. Throws std::runtime_error for layers over 65535 tiles on a
+// side.
+ScannedLayer scan_layer(const Layer &level, Jobs &jobs);
+
 void impulse_correct(const aabb::AABB &aabb1, const aabb::AABB &aabb2,
                      velocity &v1, velocity &v2, const body &b1,
                      const body &b2);
 
-void projection_correct(position &p1, aabb::AABB &aabb1, aabb::AABB &aabb2);
+void projection_correct(position &p1, aabb::AABB &aabb1,
+                        const aabb::AABB &aabb2);
 
 void projection_correct(position &p1, position &p2, aabb::AABB &aabb1,
-                        aabb::AABB &aabb2, const body &b1, const body &b2);
\ No newline at end of file
+                        aabb::AABB &aabb2, const body &b1, const body &b2);
+
+#endif // WORLD_H
@@ -0,0 +1,126 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "World.hpp"
+
+// Compares integrating bodies with one system per step, each over its own
+// view and with the acceleration kept as a component, against the fused
+// pass over the owning group of World::integrate. Leaves are moved in a
+// plain array of boxes, there is no tree. Runs on one thread.
+//
+// chonker-run-bench-integrate [bodies ...]
+
+using Clock = std::chrono::steady_clock;
+
+// Former component, written by the first system and read by the second
+class acceleration : public geom::Vector<float> {};
+
+double microseconds(Clock::duration time) {
+  return std::chrono::duration<double, std::micro>(time).count();
+}
+
+// Dynamic bodies and a tenth as many walls, which share position and body
+void populate(entt::registry &registry, unsigned int count, bool accelerate) {
+  std::mt19937 engine{1};
+  std::uniform_real_distribution<float> place{0, 4096};
+  std::uniform_real_distribution<float> speed{-3, 3};
+  for (auto i = 0u; i < count + count / 10; ++i) {
+    const auto entity = registry.create();
+    auto pos = geom::Point{place(engine), place(engine)};
+    registry.emplace<position>(entity, pos);
+    if (i % 11 == 10) {
+      registry.emplace<body>(entity, NULL_NODE, .0f, false);
+      continue;
+    }
+    registry.emplace<last_position>(entity, pos);
+    registry.emplace<velocity>(entity,
+                               geom::Vector{speed(engine), speed(engine)});
+    registry.emplace<force>(entity, geom::Vector{speed(engine), .0f});
+    registry.emplace<body>(entity, i, .02f, false);
+    if (accelerate)
+      registry.emplace<acceleration>(entity, geom::Vector{.0f, .0f});
+  }
+}
+
+// Entities are created in the same order, so they match by identifier
+bool same(entt::registry &lhs, entt::registry &rhs) {
+  auto equal = true;
+  lhs.view<position>().each([&](auto entity, auto &pos) {
+    auto &other = rhs.get<position>(entity);
+    equal = equal && pos.x == other.x && pos.y == other.y;
+  });
+  return equal;
+}
+
+void run(unsigned int count) {
+  constexpr auto TICKS = 100;
+  std::vector<aabb::AABB> boxes(count + count / 10,
+                                aabb::AABB{.0f, .0f, 16.0f, 16.0f});
+
+  entt::registry separate;
+  populate(separate, count, true);
+  auto start = Clock::now();
+  for (auto tick = 0; tick < TICKS; ++tick) {
+    separate.view<body, acceleration, force>().each(
+        [](auto &bod, auto &acc, auto &push) {
+          acc = {push * bod.inverse_mass};
+        });
+    separate.view<velocity, acceleration>().each([](auto &vel, auto &acc) {
+      vel *= 0.9f;
+      vel += acc;
+    });
+    separate.view<position, last_position, velocity, body>().each(
+        [&](auto &pos, auto &last, auto &vel, auto &bod) {
+          last = {pos};
+          pos += vel;
+          boxes[bod.node].pos += vel;
+          if (vel != geom::Vector{.0f, .0f})
+            bod.moved = true;
+        });
+  }
+  auto systems = Clock::now() - start;
+
+  entt::registry fused;
+  auto group = fused.group<position, last_position, velocity, force, body>(
+      entt::exclude<asleep>);
+  populate(fused, count, false);
+  start = Clock::now();
+  for (auto tick = 0; tick < TICKS; ++tick) {
+    group.each([&](auto &pos, auto &last, auto &vel, auto &push, auto &bod) {
+      vel *= 0.9f;
+      vel += push * bod.inverse_mass;
+      last = {pos};
+      pos += vel;
+      boxes[bod.node].pos += vel;
+      if (vel != geom::Vector{.0f, .0f})
+        bod.moved = true;
+    });
+  }
+  auto pass = Clock::now() - start;
+
+  std::cout << std::setw(10) << count << std::fixed << std::setprecision(1)
+            << std::setw(15) << microseconds(systems) / TICKS << std::setw(13)
+            << microseconds(pass) / TICKS << std::setw(10)
+            << std::setprecision(2) << (double)systems.count() / pass.count()
+            << std::setw(10) << (same(separate, fused) ? "same" : "differ")
+            << '\n';
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<unsigned int> sizes{10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (auto i = 1; i < argc; ++i)
+      sizes.push_back(std::stoul(argv[i]));
+  }
+
+  // Nothing here starts a job pool, every pass runs on this thread
+  std::cout << "threads: 1\n";
+  std::cout << "    bodies  systems us/t  fused us/t   speedup   results\n";
+  for (auto count : sizes)
+    run(count);
+}
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "World.hpp"
+
+// Compares drawing sprites layer by layer through a filtered view with the
+// pass of World::render_entities, which queries the dynamic tree for the
+// viewport and sorts the hits by layer, for a growing number of layers. The
+// view is cut down to the viewport as the renderer would. Draws are
+// collected instead of sent to a renderer.
+//
+// chonker-run-bench-sprites [sprites ...]
+
+using Clock = std::chrono::steady_clock;
+
+double microseconds(Clock::duration time) {
+  return std::chrono::duration<double, std::micro>(time).count();
+}
+
+void run(unsigned int count, int layers) {
+  constexpr auto FRAMES = 100;
+  constexpr auto SIZE = 16.0f;
+  const auto viewport = aabb::AABB{4096, 4096, 1280, 720};
+
+  std::mt19937 engine{1};
+  std::uniform_real_distribution<float> place{0, 16384};
+  std::uniform_int_distribution<int> pick{0, layers - 1};
+
+  entt::registry registry;
+  aabb::Tree tree{1.0f, count};
+  std::vector<std::pair<entt::entity, aabb::AABB>> leaves;
+  leaves.reserve(count);
+  for (auto i = 0u; i < count; ++i) {
+    const auto entity = registry.create();
+    auto pos = geom::Point{place(engine), place(engine)};
+    registry.emplace<position>(entity, pos);
+    registry.emplace<sprite>(entity, SDL_Rect{0, 0, 16, 16}, pick(engine));
+    leaves.push_back({entity, aabb::AABB{pos.x, pos.y, SIZE, SIZE}});
+  }
+  tree.build(leaves);
+
+  std::vector<SDL_FRect> draws;
+  draws.reserve(count);
+  auto emit = [&](const position &pos) {
+    draws.push_back(SDL_FRect{pos.x, pos.y, SIZE, SIZE});
+  };
+
+  auto start = Clock::now();
+  for (auto frame = 0; frame < FRAMES; ++frame) {
+    draws.clear();
+    auto view = registry.view<position, sprite>();
+    for (auto layer = 0; layer < layers; ++layer) {
+      view.each([&](auto &pos, auto &spr) {
+        if (spr.layer == layer &&
+            viewport.overlaps(aabb::AABB{pos.x, pos.y, SIZE, SIZE}))
+          emit(pos);
+      });
+    }
+  }
+  auto filtered = Clock::now() - start;
+  auto expected = draws.size();
+
+  std::vector<std::pair<int, entt::entity>> visible;
+  start = Clock::now();
+  for (auto frame = 0; frame < FRAMES; ++frame) {
+    draws.clear();
+    visible.clear();
+    tree.query(viewport, [&](unsigned int node) {
+      if (auto *spr = registry.try_get<sprite>(tree.id(node)))
+        visible.push_back({spr->layer, tree.id(node)});
+    });
+    std::sort(visible.begin(), visible.end());
+    auto current = visible.begin();
+    for (auto layer = 0; layer < layers; ++layer) {
+      for (; current != visible.end() && current->first <= layer; ++current)
+        emit(registry.get<position>(current->second));
+    }
+  }
+  auto culled = Clock::now() - start;
+
+  std::cout << std::setw(10) << count << std::setw(8) << layers << std::fixed
+            << std::setprecision(1) << std::setw(14)
+            << microseconds(filtered) / FRAMES << std::setw(14)
+            << microseconds(culled) / FRAMES << std::setw(10) << draws.size()
+            << std::setw(10) << (draws.size() == expected ? "same" : "differ")
+            << '\n';
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<unsigned int> sizes{10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (auto i = 1; i < argc; ++i)
+      sizes.push_back(std::stoul(argv[i]));
+  }
+
+  // Nothing here starts a job pool, every pass runs on this thread
+  std::cout << "threads: 1\n";
+  std::cout << "   sprites  layers  filter us/f  culled us/f     draws"
+               "   results\n";
+  for (auto count : sizes) {
+    for (auto layers : {1, 2, 4, 6, 8})
+      run(count, layers);
+  }
+}
@@ -0,0 +1,107 @@
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "AABB.hpp"
+#include "LegacyTree.hpp"
+
+// Compares the array-of-structures tree with the split node arrays on
+// insertion, region queries, refitting after movement and pair generation.
+//
+// chonker-run-bench-tree [bodies ...]
+
+using Clock = std::chrono::steady_clock;
+
+aabb::AABB &bounds(aabb::Tree &tree, unsigned int node) {
+  return tree.aabb(node);
+}
+
+aabb::AABB &bounds(aabb::legacy::Tree &tree, unsigned int node) {
+  return tree[node].aabb;
+}
+
+double milliseconds(Clock::duration time) {
+  return std::chrono::duration<double, std::milli>(time).count();
+}
+
+template <typename TreeType>
+void run(const std::string &name, unsigned int bodies) {
+  constexpr auto QUERIES = 10000;
+  constexpr auto TICKS = 100;
+  constexpr auto TILE = 16.0f;
+
+  std::mt19937 engine{1};
+  auto side = std::sqrt((float)bodies) * TILE * 2;
+  std::uniform_real_distribution<float> place{0, side};
+  std::uniform_real_distribution<float> step{-2, 2};
+  std::uniform_int_distribution<unsigned int> pick{0, bodies - 1};
+
+  TreeType tree{1.0f, 256};
+  std::vector<unsigned int> nodes;
+  nodes.reserve(bodies);
+
+  auto start = Clock::now();
+  for (auto i = 0u; i < bodies; ++i) {
+    nodes.push_back(tree.add(entt::entity(i),
+                             {place(engine), place(engine), TILE, TILE}));
+  }
+  auto insert = Clock::now() - start;
+
+  std::vector<unsigned int> stack;
+  stack.reserve(256);
+  std::size_t hits = 0;
+  start = Clock::now();
+  for (auto i = 0; i < QUERIES; ++i) {
+    aabb::AABB region{place(engine), place(engine), TILE * 4, TILE * 4};
+    tree.query(
+        region, [&](unsigned int) { ++hits; }, stack);
+  }
+  auto query = Clock::now() - start;
+
+  aabb::PairList pairs;
+  std::size_t found = 0;
+  Clock::duration update{0};
+  Clock::duration overlaps{0};
+  for (auto tick = 0; tick < TICKS; ++tick) {
+    for (auto i = 0u; i < bodies / 4; ++i) {
+      bounds(tree, nodes[pick(engine)]).pos +=
+          geom::Vector{step(engine), step(engine)};
+    }
+    start = Clock::now();
+    tree.update();
+    update += Clock::now() - start;
+    start = Clock::now();
+    tree.overlaps(pairs);
+    overlaps += Clock::now() - start;
+    found += pairs.size();
+  }
+
+  std::cout << std::left << std::setw(8) << name << std::right
+            << std::setw(10) << bodies << std::fixed << std::setprecision(3)
+            << std::setw(12) << milliseconds(insert) << std::setw(12)
+            << milliseconds(query) * 1000 / QUERIES << std::setw(12)
+            << milliseconds(update) / TICKS << std::setw(12)
+            << milliseconds(overlaps) / TICKS << std::setw(10)
+            << hits / QUERIES << std::setw(10) << found / TICKS << '\n';
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<unsigned int> sizes{1000, 10000, 100000};
+  if (argc > 1) {
+    sizes.clear();
+    for (auto i = 1; i < argc; ++i)
+      sizes.push_back(std::stoul(argv[i]));
+  }
+
+  // Nothing here starts a job pool, every pass runs on this thread
+  std::cout << "threads: 1\n";
+  std::cout << "layout      bodies   insert ms  query us/q  update ms  "
+               "pairs ms    hits/q   pairs/t\n";
+  for (auto bodies : sizes) {
+    run<aabb::legacy::Tree>("aos", bodies);
+    run<aabb::Tree>("soa", bodies);
+  }
+}
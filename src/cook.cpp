@@ -0,0 +1,42 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Level.hpp"
+#include "World.hpp"
+
+// Converts layer images into a cooked level for fast loading.
+//
+// chonker-run-cook out.level layer.png [layer.png ...]
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: chonker-run-cook out.level layer.png "
+                 "[layer.png ...]\n";
+    return EXIT_FAILURE;
+  }
+  if ((IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG) != IMG_INIT_PNG) {
+    std::cerr << SDL_GetError() << '\n';
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Layer> layers;
+  for (auto i = 2; i < argc; ++i) {
+    auto layer = read_layer(argv[i]);
+    if (layer.pixels.empty()) {
+      std::cerr << argv[i] << ": " << SDL_GetError() << '\n';
+      return EXIT_FAILURE;
+    }
+    layers.push_back(std::move(layer));
+  }
+  IMG_Quit();
+
+  std::ofstream out{argv[1], std::ios::binary};
+  if (!out || !cook_level(layers, out)) {
+    std::cerr << argv[1]
+              << ": can't write level, layers must have the same size\n";
+    return EXIT_FAILURE;
+  }
+}
@@ -0,0 +1,220 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "Level.hpp"
+#include "Profiler.hpp"
+#include "Scene.hpp"
+#include "World.hpp"
+
+// Steps the simulation without a window, renderer or texture and reports
+// its throughput. Levels come from layer images or from the generator.
+//
+// chonker-run-headless [--ticks N] [--crates N] [--bricks N] [--density F]
+//                      [--seed N] [--kick F] [--threads N] [--deterministic]
+//                      [--trace FILE] [--csv FILE] [--cook FILE]
+//                      [--level FILE [--stream] | layer.png ...]
+//
+// --threads defaults to 1, so results don't follow the host's cores.
+// --level loads a cooked level, whole or streamed around the start with
+// --stream. --cook writes the level it was given or generated as one.
+// --trace writes the profiler samples, when built with CHONKER_PROFILE.
+// --csv writes the counters of both trees for every tick.
+
+void usage() {
+  std::cerr << "usage: chonker-run-headless [--ticks N] [--crates N] "
+               "[--bricks N] [--density F] [--seed N] [--kick F] "
+               "[--threads N] [--deterministic] [--trace FILE] "
+               "[--csv FILE] [--cook FILE] [--level FILE [--stream] | "
+               "layer.png ...]\n";
+  std::exit(EXIT_FAILURE);
+}
+
+double per_tick(std::chrono::nanoseconds time, int ticks) {
+  return std::chrono::duration<double, std::milli>(time).count() / ticks;
+}
+
+double ms(std::chrono::nanoseconds time) { return per_tick(time, 1); }
+
+std::string quality(const aabb::Tree &tree) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1) << tree.size() << " nodes, height "
+      << tree.height() << ", balance " << tree.max_balance() << ", area ratio "
+      << tree.area_ratio();
+  return out.str();
+}
+
+int main(int argc, char *argv[]) {
+  SceneConfig config;
+  auto ticks = 1000;
+  auto kick = 0.0f;
+  auto threads = 1u;
+  auto deterministic = false;
+  auto stream = false;
+  std::string trace;
+  std::string csv;
+  std::string cooked;
+  std::string cook;
+  std::vector<std::string> paths;
+
+  for (auto i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      paths.push_back(arg);
+      continue;
+    }
+    if (arg == "--deterministic") {
+      deterministic = true;
+      continue;
+    }
+    if (arg == "--stream") {
+      stream = true;
+      continue;
+    }
+    if (i + 1 >= argc)
+      usage();
+    std::string value = argv[++i];
+    if (arg == "--ticks") {
+      ticks = std::stoi(value);
+    } else if (arg == "--crates") {
+      config.crates = std::stoi(value);
+    } else if (arg == "--bricks") {
+      config.bricks = std::stoi(value);
+    } else if (arg == "--density") {
+      config.density = std::stof(value);
+    } else if (arg == "--seed") {
+      config.seed = std::stoul(value);
+    } else if (arg == "--kick") {
+      kick = std::stof(value);
+    } else if (arg == "--threads") {
+      threads = std::stoul(value);
+    } else if (arg == "--trace") {
+      trace = value;
+    } else if (arg == "--csv") {
+      csv = value;
+    } else if (arg == "--level") {
+      cooked = value;
+    } else if (arg == "--cook") {
+      cook = value;
+    } else {
+      usage();
+    }
+  }
+  if (ticks <= 0 || (!cooked.empty() && (!paths.empty() || !cook.empty())) ||
+      (stream && cooked.empty()))
+    usage();
+
+  std::vector<Layer> level;
+  if (!cooked.empty()) {
+    // Loaded below, the mapping is part of the load time
+  } else if (paths.empty()) {
+    level = generate_scene(config);
+  } else {
+    if ((IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG) != IMG_INIT_PNG) {
+      std::cerr << SDL_GetError() << '\n';
+      return EXIT_FAILURE;
+    }
+    for (auto const &path : paths) {
+      auto layer = read_layer(path);
+      if (layer.pixels.empty()) {
+        std::cerr << path << ": " << SDL_GetError() << '\n';
+        return EXIT_FAILURE;
+      }
+      level.push_back(std::move(layer));
+    }
+  }
+
+  if (!cook.empty()) {
+    std::ofstream out{cook, std::ios::binary};
+    if (!out || !cook_level(level, out)) {
+      std::cerr << cook << ": can't write level\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  auto load_start = std::chrono::steady_clock::now();
+  std::unique_ptr<LevelFile> file;
+  std::unique_ptr<World> loaded;
+  try {
+    if (cooked.empty()) {
+      loaded = std::make_unique<World>(level, threads);
+    } else {
+      file = std::make_unique<LevelFile>(cooked);
+      loaded = std::make_unique<World>(*file, stream, threads);
+    }
+  } catch (const std::runtime_error &error) {
+    std::cerr << error.what() << '\n';
+    return EXIT_FAILURE;
+  }
+  auto &world = *loaded;
+  auto load_time = std::chrono::steady_clock::now() - load_start;
+  world.threads(threads, deterministic);
+  if (kick > 0)
+    world.kick(kick, config.seed);
+
+  std::ofstream rows;
+  if (!csv.empty()) {
+    rows.open(csv);
+    if (!rows) {
+      std::cerr << csv << ": can't write counters\n";
+      return EXIT_FAILURE;
+    }
+    rows << "tick,tree," << aabb::TREE_STATS_CSV << '\n';
+    world.count_trees(true);
+    world.take_tree_stats(); // drop the work of loading
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (auto tick = 0; tick < ticks; ++tick) {
+    world.update();
+    if (rows.is_open()) {
+      auto [dynamic, statics] = world.take_tree_stats();
+      for (auto [name, stats] : {std::pair{"dynamic", &dynamic},
+                                 std::pair{"static", &statics}}) {
+        rows << tick << ',' << name << ',';
+        aabb::write_csv(rows, *stats);
+        rows << '\n';
+      }
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  auto seconds = std::chrono::duration<double>(elapsed).count();
+  auto &times = world.times();
+  std::cout << std::fixed << std::setprecision(3)
+            << "bodies:        " << world.bodies() << " ("
+            << world.sleeping() << " asleep)\n"
+            << "threads:       " << threads
+            << (deterministic ? " (deterministic)" : "") << '\n'
+            << "load:          " << ms(load_time) << " ms (scan "
+            << ms(world.load_times().scan) << ", spawn "
+            << ms(world.load_times().spawn) << ", trees "
+            << ms(world.load_times().trees) << ")\n"
+            << "ticks:         " << ticks << " in " << seconds << " s\n"
+            << "ticks/sec:     " << ticks / seconds << '\n'
+            << "integration:   " << per_tick(times.integration, ticks)
+            << " ms/tick\n"
+            << "collisions:    " << per_tick(times.collisions, ticks)
+            << " ms/tick\n"
+            << "streaming:     " << per_tick(times.streaming, ticks)
+            << " ms/tick\n"
+            << "settling:      " << per_tick(times.settling, ticks)
+            << " ms/tick\n"
+            << "dynamic tree:  " << quality(world.dynamic_tree()) << '\n'
+            << "static tree:   " << quality(world.static_tree()) << '\n'
+            << "digest:        " << std::hex << world.digest() << '\n';
+
+  if (!trace.empty()) {
+    if (!profile::enabled) {
+      std::cerr << "--trace needs a build with CHONKER_PROFILE\n";
+    } else if (!profile::write_trace(trace)) {
+      std::cerr << trace << ": can't write trace\n";
+      return EXIT_FAILURE;
+    }
+  }
+}
@@ -1,7 +1,18 @@
 #include "Game.hpp"
+#include "Profiler.hpp"
 
-int main() {
-  Game game("chonker-run", "data/sprite_sheet_big_tiles.png",
-            {"data/water_test_layer1.png", "data/water_test_layer2.png"});
-  game.run();
-}
\ No newline at end of file
+// chonker-run [cooked.level], a cooked level is streamed around the player
+// and the test layers are loaded without one
+int main(int argc, char *argv[]) {
+  if (argc > 1) {
+    LevelFile level{argv[1]};
+    Game game("chonker-run", "data/sprite_sheet_big_tiles.png", level);
+    game.run();
+  } else {
+    Game game("chonker-run", "data/sprite_sheet_big_tiles.png",
+              {"data/water_test_layer1.png", "data/water_test_layer2.png"});
+    game.run();
+  }
+  if (profile::enabled)
+    profile::write_trace("trace.json");
+}